@@ -24,4 +24,4 @@ except NameError:
 except IOError as ex:
     __version__ = "unknown (%s)" % ex
 
-from .redblack import rbdict, rbset
+from .redblack import merge, rbdict, rbset, rbmultimap, rbmultiset
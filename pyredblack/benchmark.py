@@ -0,0 +1,404 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+benchmark.py
+
+Benchmarks comparing rbset and rbdict against the built-in set and
+dict (sorted on demand) and against lists kept sorted with bisect.
+
+Run with ``pyredblack-bench`` or ``python -m pyredblack.benchmark``;
+``--help`` lists the options.  Results are written as JSON, and a
+previous report can be passed with ``--compare`` to flag operations
+that have become slower.
+'''
+
+from __future__ import absolute_import, print_function
+import argparse
+import bisect
+import gc
+import json
+import os
+import platform
+import random
+import sys
+import timeit
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+from . import __version__
+from .redblack import rbdict, rbset
+
+# ============================================================
+#  Keys
+# ============================================================
+
+def make_keys(key_type, size, seed=0):
+    '''Return `size` distinct keys of the given type in random order.'''
+    rng = random.Random(seed)
+    nums = list(range(size))
+    rng.shuffle(nums)
+    if key_type == 'int':
+        return nums
+    elif key_type == 'str':
+        return ['key{:010d}'.format(num) for num in nums]
+    elif key_type == 'tuple':
+        return [(num % 97, 'k', num) for num in nums]
+    raise ValueError('unknown key type {!r}'.format(key_type))
+
+# ============================================================
+#  Implementations
+# ============================================================
+
+# Each implementation exposes the same small set of operations as
+# plain functions, so that the timing loops are identical for all of
+# them.  Ordered iteration on the hash-based containers pays for a
+# sort, as it would in real code.
+
+class RBSetImpl(object):
+    name = 'rbset'
+    kind = 'set'
+    build = staticmethod(rbset)
+    @staticmethod
+    def add(c, k): c.add(k)
+    @staticmethod
+    def contains(c, k): return k in c
+    @staticmethod
+    def remove(c, k): c.remove(k)
+    @staticmethod
+    def ordered(c): return list(c)
+    @staticmethod
+    def popmin(c): return c.pop()
+
+class SetImpl(object):
+    name = 'set+sorted'
+    kind = 'set'
+    build = staticmethod(set)
+    @staticmethod
+    def add(c, k): c.add(k)
+    @staticmethod
+    def contains(c, k): return k in c
+    @staticmethod
+    def remove(c, k): c.remove(k)
+    @staticmethod
+    def ordered(c): return sorted(c)
+    @staticmethod
+    def popmin(c):
+        k = min(c)
+        c.remove(k)
+        return k
+
+class BisectSetImpl(object):
+    name = 'bisect-list'
+    kind = 'set'
+    @staticmethod
+    def build(keys): return sorted(set(keys))
+    @staticmethod
+    def add(c, k):
+        i = bisect.bisect_left(c, k)
+        if i == len(c) or c[i] != k:
+            c.insert(i, k)
+    @staticmethod
+    def contains(c, k):
+        i = bisect.bisect_left(c, k)
+        return i != len(c) and c[i] == k
+    @staticmethod
+    def remove(c, k):
+        i = bisect.bisect_left(c, k)
+        if i == len(c) or c[i] != k:
+            raise KeyError(k)
+        del c[i]
+    @staticmethod
+    def ordered(c): return list(c)
+    @staticmethod
+    def popmin(c): return c.pop(0)
+
+class RBDictImpl(object):
+    name = 'rbdict'
+    kind = 'dict'
+    @staticmethod
+    def build(keys): return rbdict((k, k) for k in keys)
+    @staticmethod
+    def add(c, k): c[k] = k
+    @staticmethod
+    def contains(c, k): return c[k]
+    @staticmethod
+    def remove(c, k): del c[k]
+    @staticmethod
+    def ordered(c): return list(c.items())
+    @staticmethod
+    def popmin(c): return c.popitem()
+
+class DictImpl(object):
+    name = 'dict+sorted'
+    kind = 'dict'
+    @staticmethod
+    def build(keys): return dict((k, k) for k in keys)
+    @staticmethod
+    def add(c, k): c[k] = k
+    @staticmethod
+    def contains(c, k): return c[k]
+    @staticmethod
+    def remove(c, k): del c[k]
+    @staticmethod
+    def ordered(c): return sorted(c.items())
+    @staticmethod
+    def popmin(c):
+        k = min(c)
+        return (k, c.pop(k))
+
+class BisectDictImpl(object):
+    '''A dict plus a list of its keys kept sorted with bisect.'''
+    name = 'dict+bisect-list'
+    kind = 'dict'
+    @staticmethod
+    def build(keys):
+        d = dict((k, k) for k in keys)
+        return (d, sorted(d))
+    @staticmethod
+    def add(c, k):
+        d, order = c
+        if k not in d:
+            bisect.insort(order, k)
+        d[k] = k
+    @staticmethod
+    def contains(c, k): return c[0][k]
+    @staticmethod
+    def remove(c, k):
+        d, order = c
+        del d[k]
+        del order[bisect.bisect_left(order, k)]
+    @staticmethod
+    def ordered(c):
+        d, order = c
+        return [(k, d[k]) for k in order]
+    @staticmethod
+    def popmin(c):
+        d, order = c
+        k = order.pop(0)
+        return (k, d.pop(k))
+
+IMPLEMENTATIONS = [RBSetImpl, SetImpl, BisectSetImpl,
+                   RBDictImpl, DictImpl, BisectDictImpl]
+
+# ============================================================
+#  Measurement
+# ============================================================
+
+def best_time(func, repeat):
+    '''Run `func` `repeat` times and return the fastest wall time.'''
+    best = None
+    for _rep in range(repeat):
+        gc.collect()
+        start = timeit.default_timer()
+        func()
+        elapsed = timeit.default_timer() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+def current_rss():
+    '''Resident set size of this process in bytes, or None.'''
+    try:
+        with open('/proc/self/statm') as infile:
+            pages = int(infile.read().split()[1])
+        return pages * os.sysconf('SC_PAGE_SIZE')
+    except (IOError, OSError, ValueError, IndexError):
+        return None
+
+def measure_memory(impl, keys):
+    '''
+    Return the memory used by a container built from `keys`, as seen
+    by tracemalloc (Python allocations only) and by the RSS of the
+    process (which also covers the C++ tree nodes). Either may be
+    None where unavailable.
+    '''
+    gc.collect()
+    traced = None
+    if tracemalloc is not None:
+        tracemalloc.start()
+    rss_before = current_rss()
+    container = impl.build(keys)
+    rss_after = current_rss()
+    if tracemalloc is not None:
+        traced = tracemalloc.get_traced_memory()[0]
+        tracemalloc.stop()
+    rss = None
+    if rss_before is not None and rss_after is not None:
+        rss = rss_after - rss_before
+    del container
+    return traced, rss
+
+def bench_impl(impl, keys, other, repeat):
+    '''
+    Time the operations of `impl` on `keys` and yield `(op,
+    seconds, ops)` tuples. `other` is a second key list (half
+    overlapping) used for set algebra.
+    '''
+    size = len(keys)
+    yield ('construct', best_time(lambda: impl.build(keys), repeat), size)
+
+    def insert():
+        container = impl.build([])
+        for k in keys:
+            impl.add(container, k)
+    yield ('insert', best_time(insert, repeat), size)
+
+    container = impl.build(keys)
+    probes = list(keys)
+    random.Random(1).shuffle(probes)
+    def lookup():
+        for k in probes:
+            impl.contains(container, k)
+    yield ('lookup', best_time(lookup, repeat), size)
+
+    yield ('iterate_ordered',
+           best_time(lambda: impl.ordered(container), repeat), size)
+
+    def delete():
+        c = impl.build(keys)
+        for k in probes:
+            impl.remove(c, k)
+    yield ('build_and_delete', best_time(delete, repeat), size)
+
+    def popmin():
+        c = impl.build(keys)
+        for _i in range(size):
+            impl.popmin(c)
+    yield ('build_and_popmin', best_time(popmin, repeat), size)
+
+    if impl.kind == 'set' and impl is not BisectSetImpl:
+        a = impl.build(keys)
+        b = impl.build(other)
+        for op, func in (('union', lambda: a | b),
+                         ('intersection', lambda: a & b),
+                         ('difference', lambda: a - b),
+                         ('symmetric_difference', lambda: a ^ b)):
+            yield (op, best_time(func, repeat), len(keys) + len(other))
+
+def run(sizes, key_types, impl_names=None, repeat=3, log=None):
+    '''
+    Run the benchmarks and return a report (a JSON-serialisable
+    dictionary).
+    '''
+    results = []
+    impls = [impl for impl in IMPLEMENTATIONS
+             if impl_names is None or impl.name in impl_names]
+    for key_type in key_types:
+        for size in sizes:
+            keys = make_keys(key_type, size)
+            # `other` overlaps `keys` by half
+            present = set(keys)
+            more = make_keys(key_type, 2 * size, seed=1)
+            other = ([k for k in more if k not in present][:size - size // 2]
+                     + keys[:size // 2])
+            for impl in impls:
+                base = {'impl': impl.name, 'kind': impl.kind,
+                        'key_type': key_type, 'size': size}
+                for op, seconds, ops in bench_impl(impl, keys, other, repeat):
+                    row = dict(base, op=op, seconds=seconds,
+                               ns_per_op=(1e9 * seconds / ops if ops else 0.0))
+                    results.append(row)
+                    if log:
+                        log(row)
+                traced, rss = measure_memory(impl, keys)
+                row = dict(base, op='memory', traced_bytes=traced,
+                           rss_bytes=rss,
+                           bytes_per_entry=(float(rss) / size
+                                            if rss is not None and size
+                                            else None))
+                results.append(row)
+                if log:
+                    log(row)
+    return {'meta': {'pyredblack': __version__,
+                     'python': platform.python_version(),
+                     'implementation': platform.python_implementation(),
+                     'platform': platform.platform(),
+                     'repeat': repeat},
+            'results': results}
+
+def compare(report, baseline, threshold):
+    '''
+    Compare the timings in `report` to those in `baseline` and return
+    a list of `(row, ratio)` for operations that are slower by more
+    than `threshold` (e.g. 0.1 for 10%).
+    '''
+    def key(row):
+        return (row['impl'], row['key_type'], row['size'], row['op'])
+    old = dict((key(row), row) for row in baseline['results']
+               if 'seconds' in row)
+    regressions = []
+    for row in report['results']:
+        if 'seconds' not in row or key(row) not in old:
+            continue
+        before = old[key(row)]['seconds']
+        if before and row['seconds'] / before > 1.0 + threshold:
+            regressions.append((row, row['seconds'] / before))
+    return regressions
+
+# ============================================================
+#  Command line
+# ============================================================
+
+def main(argv=None):
+    '''Entry point for the ``pyredblack-bench`` command.'''
+    parser = argparse.ArgumentParser(
+        description='Benchmark rbset/rbdict against dict, set and '
+        'bisect-maintained sorted lists.')
+    parser.add_argument('--sizes', default='1000,10000,100000',
+                        help='comma-separated container sizes')
+    parser.add_argument('--key-types', default='int,str,tuple',
+                        help='comma-separated key types (int, str, tuple)')
+    parser.add_argument('--impls', default=None,
+                        help='comma-separated implementations to run '
+                        '(default: all of {})'.format(
+                            ', '.join(impl.name for impl in IMPLEMENTATIONS)))
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='repetitions per measurement (best is kept)')
+    parser.add_argument('--output', '-o', default=None,
+                        help='write the JSON report to this file '
+                        '(default: standard output)')
+    parser.add_argument('--compare', default=None,
+                        help='baseline JSON report to compare against')
+    parser.add_argument('--threshold', type=float, default=0.1,
+                        help='relative slowdown reported as a regression')
+    parser.add_argument('--quiet', '-q', action='store_true',
+                        help='do not print progress to standard error')
+    args = parser.parse_args(argv)
+
+    def log(row):
+        if 'seconds' in row:
+            desc = '{ns_per_op:12.1f} ns/op'.format(**row)
+        else:
+            desc = '{} bytes/entry (RSS)'.format(row['bytes_per_entry'])
+        print('{impl:>17} {key_type:>6} {size:>8} {op:>20} '.format(**row)
+              + desc, file=sys.stderr)
+
+    report = run([int(float(size)) for size in args.sizes.split(',')],
+                 args.key_types.split(','),
+                 args.impls.split(',') if args.impls else None,
+                 args.repeat, None if args.quiet else log)
+    text = json.dumps(report, indent=1, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as outfile:
+            outfile.write(text + '\n')
+    else:
+        print(text)
+
+    if args.compare:
+        with open(args.compare) as infile:
+            baseline = json.load(infile)
+        regressions = compare(report, baseline, args.threshold)
+        for row, ratio in regressions:
+            print('REGRESSION {impl} {key_type} {size} {op}: '
+                  '{ratio:.2f}x slower'.format(ratio=ratio, **row),
+                  file=sys.stderr)
+        if regressions:
+            return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,468 @@
+#ifndef _CONCURRENT_H_
+#define _CONCURRENT_H_
+
+// Concurrent variant of RedBlackTree for embedding in multithreaded
+// C++ code.
+//
+// Writers (insert, remove, clear) serialise on a single mutex and
+// publish their changes through a sequence lock.  Finer-grained
+// writer locking is deliberately not attempted: a red-black insert
+// or remove may recolour and rotate all the way up to the root, so
+// concurrent writers would have to lock whole paths and gain little
+// over one lock.  Readers (find, contains, snapshot) take no lock:
+// they traverse the tree optimistically and retry if a writer was
+// active in the meantime.  They read every link and value with
+// atomic loads (see rb_load_link and rb_load_value), which pair with
+// the atomic stores the writer makes to the same fields (see
+// rb_store_link in redblack.h), so that racing with the writer is
+// well defined; they validate with an acquire fence before trusting
+// what they read.  Nodes unlinked by
+// a writer are not deleted immediately but retired into a limbo
+// list and reclaimed once every reader that could still be looking
+// at them has left (epoch-based reclamation).
+//
+// Because a reader may observe a value while a writer is
+// overwriting it, Type must be trivially copyable (native keys,
+// PODs, raw pointers).
+
+#include "redblack.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <type_traits>
+
+// readers give up on the optimistic path after this many failed
+// validations and take the writer lock instead
+#define RB_OPTIMISTIC_RETRIES 64
+// deepest traversal a reader will attempt before assuming it is
+// looking at a tree in the middle of being rotated
+#define RB_MAX_DEPTH 128
+// number of retired nodes that triggers a reclamation attempt
+#define RB_RECLAIM_BATCH 256
+
+// ======================================================================
+//  RACY READS
+// ======================================================================
+
+// loads a node link that a writer may be storing to concurrently;
+// pairs with the release store in rb_store_link
+template <typename Type>
+static inline Node<Type>* rb_load_link(Node<Type>* const &link)
+{
+    return __atomic_load_n(&link, __ATOMIC_ACQUIRE);
+}
+
+// copies a value that a writer may be storing to concurrently; the
+// copy may be torn, which the sequence lock detects
+template <typename Type>
+static inline Type rb_load_value(const Type &value)
+{
+    Type rv;
+    rb_relaxed_copy(rv, value);
+    return rv;
+}
+
+// ======================================================================
+//  EPOCHS
+// ======================================================================
+
+// process-wide table of reader epochs; each reading thread owns one
+// slot for its lifetime
+class RedBlackEpoch
+{
+public:
+    static const unsigned MaxSlots = 256;
+
+    struct alignas(64) Slot
+    {
+        // 0 when the owning thread is not inside a read section
+        std::atomic<unsigned long> epoch;
+        std::atomic<bool> used;
+    };
+
+    static std::atomic<unsigned long>& global()
+    {
+        static std::atomic<unsigned long> g(1);
+        return g;
+    };
+    static Slot* slots()
+    {
+        static Slot s[MaxSlots];
+        return s;
+    };
+    // this thread's slot, or 0 if all slots are taken
+    static Slot* local()
+    {
+        static thread_local Handle h;
+        return h.slot;
+    };
+    // smallest epoch of any thread currently inside a read section
+    static unsigned long min_active()
+    {
+        unsigned long rv = ~0UL;
+        Slot *s = slots();
+        for (unsigned i = 0; i < MaxSlots; ++i)
+        {
+            unsigned long e = s[i].epoch.load(std::memory_order_seq_cst);
+            if (e && e < rv) rv = e;
+        }
+        return rv;
+    };
+
+private:
+    struct Handle
+    {
+        Handle() : slot(0)
+        {
+            Slot *s = slots();
+            for (unsigned i = 0; i < MaxSlots; ++i)
+            {
+                bool expected = false;
+                if (s[i].used.compare_exchange_strong(expected, true))
+                {
+                    slot = &s[i];
+                    break;
+                }
+            }
+        };
+        ~Handle()
+        {
+            if (slot)
+            {
+                slot->epoch.store(0, std::memory_order_release);
+                slot->used.store(false, std::memory_order_release);
+            }
+        };
+        Slot *slot;
+    };
+};
+
+// scoped read section: pins the current epoch so that nothing the
+// reader can reach is reclaimed underneath it
+class RedBlackReadGuard
+{
+public:
+    RedBlackReadGuard() : slot(RedBlackEpoch::local())
+    {
+        if (slot)
+            slot->epoch.store(RedBlackEpoch::global().load(),
+                              std::memory_order_seq_cst);
+    };
+    ~RedBlackReadGuard()
+    {
+        if (slot) slot->epoch.store(0, std::memory_order_release);
+    };
+    bool pinned() const {return (this->slot != 0);};
+private:
+    RedBlackEpoch::Slot *slot;
+};
+
+// ======================================================================
+//  TREE
+// ======================================================================
+
+template <typename Type, typename Comp = std::less< Type > >
+class ConcurrentRedBlackTree : protected RedBlackTree<Type, Comp>
+{
+    static_assert(std::is_trivially_copyable<Type>::value,
+                  "ConcurrentRedBlackTree requires a trivially copyable Type");
+
+public:
+    ConcurrentRedBlackTree();
+    virtual ~ConcurrentRedBlackTree();
+
+    // writers
+    bool insert(const Type &value);
+    bool remove(const Type &value, Type &out_Value);
+    void clear();
+
+    // lock-free readers
+    bool find(const Type &in_Value, Type &out_Value) const;
+    bool contains(const Type &in_Value) const;
+    size_t snapshot(vector<Type> &out) const;
+    size_t size() const {return this->count.load(std::memory_order_relaxed);};
+
+protected:
+    virtual void free_node(Node<Type> *node);
+
+private:
+    void write_begin();
+    void write_end();
+    unsigned long read_begin() const;
+    bool read_validate(unsigned long seq) const;
+    bool _find(const Type &in_Value, Type &out_Value, bool &ok) const;
+    void _walk(vector<Type> &out, unsigned long seq, bool &ok) const;
+    void reclaim();
+
+    mutable std::mutex writer;
+    std::atomic<unsigned long> seq;
+    std::atomic<size_t> count;
+    // retired subtrees paired with the epoch they were retired in
+    vector< pair<Node<Type>*, unsigned long> > limbo;
+};
+
+template <typename Type, typename Comp>
+ConcurrentRedBlackTree<Type, Comp>::ConcurrentRedBlackTree()
+    : seq(0), count(0)
+{
+}
+
+template <typename Type, typename Comp>
+ConcurrentRedBlackTree<Type, Comp>::~ConcurrentRedBlackTree()
+{
+    // no readers may be active once the tree is being destroyed
+    for (size_t i = 0; i < this->limbo.size(); ++i)
+        RedBlackTree<Type, Comp>::free_subtree(this->limbo[i].first);
+    this->limbo.clear();
+}
+
+template <typename Type, typename Comp>
+void
+ConcurrentRedBlackTree<Type, Comp>::write_begin()
+{
+    unsigned long s = this->seq.load(std::memory_order_relaxed);
+    this->seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+template <typename Type, typename Comp>
+void
+ConcurrentRedBlackTree<Type, Comp>::write_end()
+{
+    this->seq.store(this->seq.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+}
+
+template <typename Type, typename Comp>
+unsigned long
+ConcurrentRedBlackTree<Type, Comp>::read_begin() const
+{
+    unsigned long s;
+    while ((s = this->seq.load(std::memory_order_acquire)) & 1)
+        std::this_thread::yield();
+    return s;
+}
+
+template <typename Type, typename Comp>
+bool
+ConcurrentRedBlackTree<Type, Comp>::read_validate(unsigned long s) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (this->seq.load(std::memory_order_relaxed) == s);
+}
+
+/**
+ * Inserts a copy of `value` into the tree.
+ *
+ * \return True if the tree is changed by the operation; false
+ * otherwise (i.e., value was already contained in the tree).
+ */
+template <typename Type, typename Comp>
+bool
+ConcurrentRedBlackTree<Type, Comp>::insert(const Type &value)
+{
+    std::lock_guard<std::mutex> lock(this->writer);
+    RedBlackTreeIterator<Type, Comp> found;
+    write_begin();
+    bool rv = RedBlackTree<Type, Comp>::insert(value, found);
+    write_end();
+    if (rv) this->count.fetch_add(1, std::memory_order_relaxed);
+    return rv;
+}
+
+template <typename Type, typename Comp>
+bool
+ConcurrentRedBlackTree<Type, Comp>::remove(const Type &value,
+                                           Type &out_Value)
+{
+    std::lock_guard<std::mutex> lock(this->writer);
+    write_begin();
+    bool rv = RedBlackTree<Type, Comp>::remove(value, out_Value);
+    write_end();
+    if (rv) this->count.fetch_sub(1, std::memory_order_relaxed);
+    if (this->limbo.size() >= RB_RECLAIM_BATCH) reclaim();
+    return rv;
+}
+
+template <typename Type, typename Comp>
+void
+ConcurrentRedBlackTree<Type, Comp>::clear()
+{
+    std::lock_guard<std::mutex> lock(this->writer);
+    write_begin();
+    RedBlackTree<Type, Comp>::clear();
+    write_end();
+    this->count.store(0, std::memory_order_relaxed);
+    reclaim();
+}
+
+/**
+ * Looks up `in_Value` without taking the writer lock.
+ *
+ * \param in_Value the value to look for
+ * \param out_Value receives a copy of the stored value if found
+ * \return True if the tree contains a value equal to `in_Value`
+ */
+template <typename Type, typename Comp>
+bool
+ConcurrentRedBlackTree<Type, Comp>::find(const Type &in_Value,
+                                         Type &out_Value) const
+{
+    RedBlackReadGuard guard;
+    if (guard.pinned())
+    {
+        for (int attempt = 0; attempt < RB_OPTIMISTIC_RETRIES; ++attempt)
+        {
+            unsigned long s = read_begin();
+            bool ok = true;
+            Type result = Type();
+            bool found = _find(in_Value, result, ok);
+            if (ok && read_validate(s))
+            {
+                if (found) out_Value = result;
+                return found;
+            }
+        }
+    }
+    // too much writer traffic (or no epoch slot): read under the lock
+    std::lock_guard<std::mutex> lock(this->writer);
+    bool ok = true;
+    return _find(in_Value, out_Value, ok);
+}
+
+template <typename Type, typename Comp>
+bool
+ConcurrentRedBlackTree<Type, Comp>::contains(const Type &in_Value) const
+{
+    Type ignored;
+    return find(in_Value, ignored);
+}
+
+/**
+ * Copies the contents of the tree, in order, into `out`.  The copy
+ * is a consistent view of the tree at a single point in time.
+ *
+ * \return the number of values copied
+ */
+template <typename Type, typename Comp>
+size_t
+ConcurrentRedBlackTree<Type, Comp>::snapshot(vector<Type> &out) const
+{
+    RedBlackReadGuard guard;
+    if (guard.pinned())
+    {
+        for (int attempt = 0; attempt < RB_OPTIMISTIC_RETRIES; ++attempt)
+        {
+            out.clear();
+            unsigned long s = read_begin();
+            out.reserve(this->size());
+            bool ok = true;
+            _walk(out, s, ok);
+            if (ok && read_validate(s)) return out.size();
+        }
+    }
+    std::lock_guard<std::mutex> lock(this->writer);
+    out.clear();
+    bool ok = true;
+    _walk(out, this->seq.load(std::memory_order_relaxed), ok);
+    return out.size();
+}
+
+template <typename Type, typename Comp>
+bool
+ConcurrentRedBlackTree<Type, Comp>::_find(const Type &in_Value,
+                                          Type &out_Value,
+                                          bool &ok) const
+{
+    Type key = in_Value;
+    Comp comp;
+    Node<Type> *current = rb_load_link(this->getRootLink());
+    for (int depth = 0; current; ++depth)
+    {
+        if (depth > RB_MAX_DEPTH)
+        {
+            ok = false;
+            return false;
+        }
+        Type value = rb_load_value(current->value);
+        if (comp(key, value))
+            current = rb_load_link(current->left);
+        else if (comp(value, key))
+            current = rb_load_link(current->right);
+        else
+        {
+            out_Value = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// in-order traversal that reads every link exactly once and keeps
+// its own stack, so that a concurrent rotation can at worst make it
+// produce garbage (caught by the caller's validation), never crash
+template <typename Type, typename Comp>
+void
+ConcurrentRedBlackTree<Type, Comp>::_walk(vector<Type> &out,
+                                          unsigned long s,
+                                          bool &ok) const
+{
+    Node<Type> *stack[RB_MAX_DEPTH];
+    int depth = 0;
+    size_t steps = 0;
+    Node<Type> *current = rb_load_link(this->getRootLink());
+    while (current || depth)
+    {
+        while (current)
+        {
+            if (depth == RB_MAX_DEPTH)
+            {
+                ok = false;
+                return;
+            }
+            stack[depth++] = current;
+            current = rb_load_link(current->left);
+        }
+        current = stack[--depth];
+        out.push_back(rb_load_value(current->value));
+        current = rb_load_link(current->right);
+        // bail out early if a writer has come along
+        if ((++steps & 1023) == 0 && !read_validate(s))
+        {
+            ok = false;
+            return;
+        }
+    }
+}
+
+template <typename Type, typename Comp>
+void
+ConcurrentRedBlackTree<Type, Comp>::free_node(Node<Type> *node)
+{
+    // called with the writer lock held
+    this->limbo.push_back(
+        make_pair(node, RedBlackEpoch::global().load(std::memory_order_relaxed)));
+}
+
+template <typename Type, typename Comp>
+void
+ConcurrentRedBlackTree<Type, Comp>::reclaim()
+{
+    // called with the writer lock held; readers entering from here
+    // on pin the new epoch and cannot reach anything in limbo
+    RedBlackEpoch::global().fetch_add(1, std::memory_order_seq_cst);
+    unsigned long safe = RedBlackEpoch::min_active();
+    size_t kept = 0;
+    for (size_t i = 0; i < this->limbo.size(); ++i)
+    {
+        if (this->limbo[i].second < safe)
+            RedBlackTree<Type, Comp>::free_subtree(this->limbo[i].first);
+        else
+            this->limbo[kept++] = this->limbo[i];
+    }
+    this->limbo.resize(kept);
+}
+
+#endif /* _CONCURRENT_H_ */
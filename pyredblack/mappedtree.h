@@ -0,0 +1,341 @@
+#ifndef _MAPPEDTREE_H_
+#define _MAPPEDTREE_H_
+
+// Read-only trees of native keys and values backed by a memory-mapped
+// file.
+//
+// MappedRedBlackTree::write exports sorted (key, value) pairs (for
+// instance, a RedBlackTree< pair<Key, Value> >) into a file of
+// fixed-size nodes linked by array indices rather than pointers, so
+// that the file is position independent.  Nodes are laid out in key
+// order, which makes iteration a linear scan; the links describe a
+// perfectly balanced search tree over them.
+//
+// MappedRedBlackTree::open maps such a file read-only with no
+// deserialisation, and offers the same find/begin/end/iteration
+// interface as RedBlackTree.  Any number of processes can map the
+// same file and share its pages through the OS page cache.
+
+#include "redblack.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+
+#define RB_MAPPED_MAGIC "PYRBMAP1"
+#define RB_MAPPED_NIL (~(uint64_t)0)
+// the trees written are perfectly balanced, so no search in a valid
+// file goes deeper than this
+#define RB_MAPPED_MAX_DEPTH 64
+
+template <typename Key, typename Value>
+struct MappedEntry
+{
+    Key first;
+    Value second;
+};
+
+template <typename Key, typename Value>
+struct MappedNode
+{
+    MappedEntry<Key, Value> value;
+    uint64_t left;
+    uint64_t right;
+};
+
+struct MappedHeader
+{
+    char magic[8];
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t node_size;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t root;
+};
+
+template <typename Key, typename Value, typename Comp = std::less< Key > >
+class MappedRedBlackTree;
+
+template <typename Key, typename Value, typename Comp = std::less< Key > >
+class MappedRedBlackTreeIterator
+{
+    friend class MappedRedBlackTree<Key, Value, Comp>;
+
+public:
+    MappedRedBlackTreeIterator() : current(0), last(0), dir(0) {};
+    MappedRedBlackTreeIterator(const MappedNode<Key, Value> *s,
+                               const MappedNode<Key, Value> *l, int d)
+        : current(s), last(l), dir(d) {};
+
+    MappedRedBlackTreeIterator<Key, Value, Comp>& operator++()
+    {
+        if (!this->current)
+            throw exception();
+        if (++this->current == this->last) this->current = 0;
+        return *this;
+    };
+    const MappedEntry<Key, Value>& operator*() const
+    {
+        if (!this->current)
+            throw exception();
+        return this->current->value;
+    };
+    bool operator==(const MappedRedBlackTreeIterator<Key, Value, Comp> &i) const
+    {return (this->current == i.current);};
+    bool operator!=(const MappedRedBlackTreeIterator<Key, Value, Comp> &i) const
+    {return (this->current != i.current);};
+
+    bool        valid() const {return (this->current != 0);}
+    int         getDir() const {return this->dir;};
+private:
+    const MappedNode<Key, Value> *current;
+    const MappedNode<Key, Value> *last;
+    int dir;
+};
+
+template <typename Key, typename Value, typename Comp>
+class MappedRedBlackTree
+{
+    static_assert(std::is_trivially_copyable<Key>::value &&
+                  std::is_trivially_copyable<Value>::value,
+                  "MappedRedBlackTree requires trivially copyable keys and values");
+
+public:
+    typedef MappedRedBlackTreeIterator<Key, Value, Comp> iterator;
+
+    MappedRedBlackTree();
+    ~MappedRedBlackTree();
+
+    template <typename Iter>
+    static bool write(const string &path, Iter first, Iter last);
+
+    bool open(const string &path);
+    void close();
+
+    iterator find(const Key &in_Key) const;
+    iterator lower_bound(const Key &in_Key) const;
+    iterator upper_bound(const Key &in_Key) const;
+    iterator begin() const;
+    iterator end() const {return iterator();};
+    size_t size() const {return this->count;};
+
+private:
+    iterator at(uint64_t index, int dir) const;
+
+    void *base;
+    size_t length;
+    const MappedNode<Key, Value> *nodes;
+    uint64_t count;
+    uint64_t root;
+    Comp comp;
+};
+
+template <typename Key, typename Value, typename Comp>
+MappedRedBlackTree<Key, Value, Comp>::MappedRedBlackTree()
+    : base(0), length(0), nodes(0), count(0), root(RB_MAPPED_NIL)
+{
+}
+
+template <typename Key, typename Value, typename Comp>
+MappedRedBlackTree<Key, Value, Comp>::~MappedRedBlackTree()
+{
+    close();
+}
+
+/**
+ * Writes the (key, value) pairs in [first, last) to a file at
+ * `path`.  The keys must be strictly increasing, which is the case
+ * when iterating over a RedBlackTree.
+ *
+ * \return True if the file was written successfully
+ */
+template <typename Key, typename Value, typename Comp>
+template <typename Iter>
+bool
+MappedRedBlackTree<Key, Value, Comp>::write(const string &path,
+                                            Iter first, Iter last)
+{
+    vector< MappedNode<Key, Value> > out;
+    for (; first != last; ++first)
+    {
+        MappedNode<Key, Value> node;
+        memset(&node, 0, sizeof(node));
+        node.value.first = (*first).first;
+        node.value.second = (*first).second;
+        out.push_back(node);
+    }
+    // link the nodes into a balanced tree by median splits, using
+    // an explicit stack of [lo, hi) ranges and the parent slot that
+    // each range's median should be stored in
+    MappedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RB_MAPPED_MAGIC, sizeof(header.magic));
+    header.key_size = sizeof(Key);
+    header.value_size = sizeof(Value);
+    header.node_size = sizeof(MappedNode<Key, Value>);
+    header.count = out.size();
+    header.root = RB_MAPPED_NIL;
+    vector< pair< pair<uint64_t, uint64_t>, uint64_t* > > ranges;
+    ranges.push_back(make_pair(make_pair((uint64_t)0, (uint64_t)out.size()),
+                               &header.root));
+    while (!ranges.empty())
+    {
+        uint64_t lo = ranges.back().first.first;
+        uint64_t hi = ranges.back().first.second;
+        uint64_t *slot = ranges.back().second;
+        ranges.pop_back();
+        if (lo >= hi)
+        {
+            *slot = RB_MAPPED_NIL;
+            continue;
+        }
+        uint64_t mid = lo + (hi - lo) / 2;
+        *slot = mid;
+        ranges.push_back(make_pair(make_pair(lo, mid), &out[mid].left));
+        ranges.push_back(make_pair(make_pair(mid + 1, hi), &out[mid].right));
+    }
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    bool ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+    if (ok && !out.empty())
+        ok = (fwrite(&out[0], sizeof(out[0]), out.size(), f) == out.size());
+    if (fclose(f) != 0) ok = false;
+    return ok;
+}
+
+/**
+ * Maps the file at `path` (written by `write`) read-only.  The
+ * header is checked here; the links between nodes are checked as
+ * they are followed, so that a corrupt file cannot cause reads
+ * outside the mapping.
+ *
+ * \return True if the file was mapped and has a valid header
+ */
+template <typename Key, typename Value, typename Comp>
+bool
+MappedRedBlackTree<Key, Value, Comp>::open(const string &path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MappedHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    void *mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+    const MappedHeader *header = (const MappedHeader*)mapped;
+    // compare the node count by division, which cannot overflow
+    size_t body = st.st_size - sizeof(MappedHeader);
+    if (memcmp(header->magic, RB_MAPPED_MAGIC, sizeof(header->magic)) != 0 ||
+        header->key_size != sizeof(Key) ||
+        header->value_size != sizeof(Value) ||
+        header->node_size != sizeof(MappedNode<Key, Value>) ||
+        body % sizeof(MappedNode<Key, Value>) != 0 ||
+        header->count != body / sizeof(MappedNode<Key, Value>) ||
+        (header->count ? header->root >= header->count
+         : header->root != RB_MAPPED_NIL))
+    {
+        munmap(mapped, st.st_size);
+        return false;
+    }
+    this->base = mapped;
+    this->length = st.st_size;
+    this->nodes = (const MappedNode<Key, Value>*)(header + 1);
+    this->count = header->count;
+    this->root = header->root;
+    return true;
+}
+
+template <typename Key, typename Value, typename Comp>
+void
+MappedRedBlackTree<Key, Value, Comp>::close()
+{
+    if (this->base) munmap(this->base, this->length);
+    this->base = 0;
+    this->length = 0;
+    this->nodes = 0;
+    this->count = 0;
+    this->root = RB_MAPPED_NIL;
+}
+
+template <typename Key, typename Value, typename Comp>
+MappedRedBlackTreeIterator<Key, Value, Comp>
+MappedRedBlackTree<Key, Value, Comp>::at(uint64_t index, int dir) const
+{
+    if (index >= this->count) return iterator();
+    return iterator(this->nodes + index, this->nodes + this->count, dir);
+}
+
+/**
+ * Finds `in_Key` in the tree, with the same semantics as
+ * RedBlackTree::find: if the key is not present, the iterator points
+ * at the node where the search stopped and getDir() tells which side
+ * of it the key would go.  A search that meets a link out of range,
+ * or goes deeper than any valid file allows, finds nothing.
+ */
+template <typename Key, typename Value, typename Comp>
+MappedRedBlackTreeIterator<Key, Value, Comp>
+MappedRedBlackTree<Key, Value, Comp>::find(const Key &in_Key) const
+{
+    uint64_t current = this->root;
+    for (int depth = 0; current != RB_MAPPED_NIL; ++depth)
+    {
+        if (current >= this->count || depth > RB_MAPPED_MAX_DEPTH)
+            return iterator();
+        const MappedNode<Key, Value> &node = this->nodes[current];
+        if (comp(in_Key, node.value.first))
+        {
+            if (node.left == RB_MAPPED_NIL) return at(current, -1);
+            current = node.left;
+        }
+        else if (comp(node.value.first, in_Key))
+        {
+            if (node.right == RB_MAPPED_NIL) return at(current, 1);
+            current = node.right;
+        }
+        else
+            return at(current, 0);
+    }
+    return iterator();
+}
+
+// first entry whose key is not less than `in_Key`
+template <typename Key, typename Value, typename Comp>
+MappedRedBlackTreeIterator<Key, Value, Comp>
+MappedRedBlackTree<Key, Value, Comp>::lower_bound(const Key &in_Key) const
+{
+    iterator it = find(in_Key);
+    if (!it.valid()) return it;
+    uint64_t index = it.current - this->nodes;
+    return at(it.getDir() > 0 ? index + 1 : index, 0);
+}
+
+// first entry whose key is greater than `in_Key`
+template <typename Key, typename Value, typename Comp>
+MappedRedBlackTreeIterator<Key, Value, Comp>
+MappedRedBlackTree<Key, Value, Comp>::upper_bound(const Key &in_Key) const
+{
+    iterator it = find(in_Key);
+    if (!it.valid()) return it;
+    uint64_t index = it.current - this->nodes;
+    return at(it.getDir() >= 0 ? index + 1 : index, 0);
+}
+
+template <typename Key, typename Value, typename Comp>
+MappedRedBlackTreeIterator<Key, Value, Comp>
+MappedRedBlackTree<Key, Value, Comp>::begin() const
+{
+    return at(0, 0);
+}
+
+#endif /* _MAPPEDTREE_H_ */
@@ -0,0 +1,236 @@
+#ifndef _MERGE_H_
+#define _MERGE_H_
+
+// K-way merge over several RedBlackTrees of the same type.
+//
+// RedBlackMerge walks any number of trees (or ranges of them) at once
+// and yields their values in global order, ascending or descending.
+// The next value is chosen with a loser tree (tournament tree): after
+// each step only the path from the advanced source up to the root is
+// replayed, which costs log2(k) comparisons for k sources rather than
+// the 2 log2(k) of a binary heap.
+//
+// Equal values are yielded in the order in which their trees were
+// added; with deduplication, only the first of a run of equal values
+// is yielded.  The trees must not be modified while a merge is
+// walking them.
+
+#include "redblack.h"
+#include <vector>
+
+template <typename Type, typename Comp = std::less< Type > >
+class RedBlackMerge
+{
+public:
+    typedef RedBlackTreeIterator<Type, Comp> iterator;
+
+    RedBlackMerge(bool dedupe = false, bool reverse = false)
+        : dedupe(dedupe), reverse(reverse), started(false) {};
+
+    void add(const RedBlackTree<Type, Comp> &tree, Type *lo = 0, Type *hi = 0);
+
+    bool valid();
+    Type& operator*();
+    RedBlackMerge<Type, Comp>& operator++();
+    // index (in order of add) of the tree holding the current value
+    size_t source();
+
+    // appends the remaining values to `out`, in merge order
+    void drain(vector<Type> &out);
+    // as drain, but keeps only the first of each run of equal values
+    void drain_unique(vector<Type> &out);
+
+private:
+    struct Source
+    {
+        iterator current;
+        iterator stop;
+        bool done() {return !this->current.valid() ||
+                this->current == this->stop;};
+    };
+
+    void start();
+    bool beats(size_t a, size_t b);
+    void replay(size_t s);
+    void advance();
+
+    vector<Source> sources;
+    // losers[0] is the overall winner, losers[1..k-1] the loser at
+    // each internal node of the tournament
+    vector<size_t> losers;
+    Comp comp;
+    bool dedupe;
+    bool reverse;
+    bool started;
+};
+
+/**
+ * Adds a tree to the merge, optionally restricted to the values `v`
+ * with `*lo <= v < *hi`.  Must be called before the first value is
+ * read.
+ */
+template <typename Type, typename Comp>
+void
+RedBlackMerge<Type, Comp>::add(const RedBlackTree<Type, Comp> &tree,
+                               Type *lo, Type *hi)
+{
+    Source source;
+    if (lo && hi && !comp(*lo, *hi))
+    {
+        // empty range
+        this->sources.push_back(source);
+        return;
+    }
+    iterator first = lo ? tree.lower_bound(*lo) : tree.begin();
+    iterator last = hi ? tree.lower_bound(*hi) : tree.end();
+    if (!this->reverse)
+    {
+        source.current = first;
+        source.stop = last;
+    }
+    else
+    {
+        // walk backwards from the value before `last` to the one
+        // before `first`; stepping back from end() means last()
+        source.current = last.valid() ? --last : tree.last();
+        source.stop = first.valid() ? --first : tree.last();
+    }
+    this->sources.push_back(source);
+}
+
+// true if source `a` should be yielded before source `b`
+template <typename Type, typename Comp>
+bool
+RedBlackMerge<Type, Comp>::beats(size_t a, size_t b)
+{
+    if (this->sources[a].done()) return false;
+    if (this->sources[b].done()) return true;
+    Type &va = *this->sources[a].current;
+    Type &vb = *this->sources[b].current;
+    if (this->reverse ? comp(vb, va) : comp(va, vb)) return true;
+    if (this->reverse ? comp(va, vb) : comp(vb, va)) return false;
+    return a < b;
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackMerge<Type, Comp>::start()
+{
+    this->started = true;
+    size_t k = this->sources.size();
+    if (!k) return;
+    // play the initial tournament bottom-up; leaf i sits at k + i
+    vector<size_t> winners(2 * k);
+    this->losers.assign(k, 0);
+    for (size_t i = 0; i < k; ++i)
+        winners[k + i] = i;
+    for (size_t n = k - 1; n >= 1; --n)
+    {
+        size_t a = winners[2 * n];
+        size_t b = winners[2 * n + 1];
+        if (beats(a, b))
+        {
+            winners[n] = a;
+            this->losers[n] = b;
+        }
+        else
+        {
+            winners[n] = b;
+            this->losers[n] = a;
+        }
+    }
+    this->losers[0] = winners[1];
+}
+
+// replays the matches on the path from leaf `s` to the root
+template <typename Type, typename Comp>
+void
+RedBlackMerge<Type, Comp>::replay(size_t s)
+{
+    size_t winner = s;
+    for (size_t n = (s + this->sources.size()) / 2; n >= 1; n /= 2)
+    {
+        if (beats(this->losers[n], winner))
+            swap(this->losers[n], winner);
+    }
+    this->losers[0] = winner;
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackMerge<Type, Comp>::advance()
+{
+    size_t s = this->losers[0];
+    if (this->reverse) --this->sources[s].current;
+    else ++this->sources[s].current;
+    replay(s);
+}
+
+template <typename Type, typename Comp>
+bool
+RedBlackMerge<Type, Comp>::valid()
+{
+    if (!this->started) start();
+    return !this->sources.empty() && !this->sources[this->losers[0]].done();
+}
+
+template <typename Type, typename Comp>
+Type&
+RedBlackMerge<Type, Comp>::operator*()
+{
+    if (!valid())
+        throw exception();
+    return *this->sources[this->losers[0]].current;
+}
+
+template <typename Type, typename Comp>
+size_t
+RedBlackMerge<Type, Comp>::source()
+{
+    if (!valid())
+        throw exception();
+    return this->losers[0];
+}
+
+template <typename Type, typename Comp>
+RedBlackMerge<Type, Comp>&
+RedBlackMerge<Type, Comp>::operator++()
+{
+    if (!valid())
+        throw exception();
+    // the value lives in a tree node, so it stays put while the
+    // other sources move
+    Type &previous = **this;
+    advance();
+    if (this->dedupe)
+    {
+        while (valid() && !comp(previous, **this) && !comp(**this, previous))
+            advance();
+    }
+    return *this;
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackMerge<Type, Comp>::drain(vector<Type> &out)
+{
+    for (; valid(); ++(*this))
+        out.push_back(**this);
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackMerge<Type, Comp>::drain_unique(vector<Type> &out)
+{
+    size_t start = out.size();
+    for (; valid(); ++(*this))
+    {
+        Type &value = **this;
+        if (out.size() > start &&
+            !comp(out.back(), value) && !comp(value, out.back()))
+            continue;
+        out.push_back(value);
+    }
+}
+
+#endif /* _MERGE_H_ */
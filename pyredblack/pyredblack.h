@@ -5,9 +5,15 @@
 
 #include <Python.h>
 #include "redblack.h"
+#include "merge.h"
 #include <utility>
+#include <stdint.h>
 using namespace std;
 
+// number of nodes left by an incremental clear that each later
+// update frees
+#define RB_DRAIN_STEP 64
+
 typedef Node<PyObject*> ObjectNode;
 struct pyobjcmp
 {
@@ -16,12 +22,17 @@ struct pyobjcmp
         return (PyObject_RichCompareBool(o1, o2, Py_LT) == 1);
     }
 };
+struct pyobjdispose
+{
+    void operator()(PyObject* &obj) const {Py_XDECREF(obj);}
+};
 typedef RedBlackTreeIterator<PyObject*, pyobjcmp> ObjectRBTreeIterator;
 class ObjectRBTree : public RedBlackTree<PyObject*, pyobjcmp>
 {
 public:
     bool del_obj(PyObject *obj)
     {
+        reclaim_step();
         PyObject *found;
         if (remove(obj, found))
         {
@@ -32,6 +43,7 @@ public:
     };
     bool add_obj(PyObject *obj)
     {
+        reclaim_step();
         ObjectRBTreeIterator found;
         if (insert(obj, found))
         {
@@ -40,13 +52,115 @@ public:
         }
         else return false;
     };
+    // adds `obj` to a set that holds at most `maxlen` objects, of
+    // which there are currently `size`; when the set is full, the
+    // smallest object (or the largest, with `evict_max`) is evicted
+    // to make room.  An object that would be evicted straight away is
+    // rejected after a single comparison with the cached first (last)
+    // node, without allocating.  Returns true if the set grew.
+    bool add_obj_bounded(PyObject *obj, size_t size, size_t maxlen,
+                         bool evict_max)
+    {
+        if (maxlen == 0) return false;
+        if (size >= maxlen &&
+            PyObject_RichCompareBool(obj, evict_max ? *last() : *begin(),
+                                     evict_max ? Py_GT : Py_LT) == 1)
+            return false;
+        if (!add_obj(obj)) return false;
+        if (size < maxlen) return true;
+        ObjectRBTreeIterator it = evict_max ? last() : begin();
+        PyObject *found;
+        if (remove(it, found))
+            Py_XDECREF(found);
+        return false;
+    };
+    // multiset operations: equal objects may be stored more than
+    // once, and are kept in the order they were added
+    void add_obj_multi(PyObject *obj)
+    {
+        reclaim_step();
+        ObjectRBTreeIterator found;
+        insert_multi(obj, found);
+        Py_XINCREF(obj);
+    };
+    ObjectRBTreeIterator lower_bound_obj(PyObject *obj)
+    {
+        return lower_bound(obj);
+    };
+    ObjectRBTreeIterator upper_bound_obj(PyObject *obj)
+    {
+        return upper_bound(obj);
+    };
+    size_t count_obj(PyObject *obj)
+    {
+        size_t count = 0;
+        for (ObjectRBTreeIterator it = lower_bound(obj);
+             it.valid() && PyObject_RichCompareBool(obj, *it, Py_LT) != 1;
+             ++it)
+            ++count;
+        return count;
+    };
+    // removes the first-added of the objects equal to `obj`
+    bool del_obj_first(PyObject *obj)
+    {
+        reclaim_step();
+        ObjectRBTreeIterator it = lower_bound(obj);
+        if (!it.valid() || PyObject_RichCompareBool(obj, *it, Py_LT) == 1)
+            return false;
+        PyObject *found;
+        if (remove(it, found))
+        {
+            Py_XDECREF(found);
+            return true;
+        }
+        return false;
+    };
+    size_t del_obj_all(PyObject *obj)
+    {
+        size_t count = 0;
+        while (del_obj_first(obj)) ++count;
+        return count;
+    };
+    // empties the tree, releasing the objects as their nodes are
+    // freed in a single pass; the tree is unlinked first, so any code
+    // run by the releases sees it empty
     void clear_objs()
     {
-        for (ObjectRBTreeIterator it = begin(); it != end(); ++it)
+        pyobjdispose dispose;
+        ObjectNode *node = release();
+        destroy(node, (size_t)-1, dispose);
+        drain((size_t)-1, dispose);
+    };
+    // empties the tree in O(1), leaving the nodes (and the objects)
+    // to be freed a few at a time by later updates, or by drain_objs
+    void clear_objs_incremental() {detach();};
+    size_t drain_objs(size_t limit) {return drain(limit, pyobjdispose());};
+    // called on entry to updates, to free some of the nodes left by
+    // clear_objs_incremental
+    void reclaim_step() {if (has_detached()) drain_objs(RB_DRAIN_STEP);};
+    // replaces the contents of the tree with the objects in `seq`
+    // (a list or tuple) in O(n); if `check` is set, returns false
+    // without changing anything unless the objects are strictly
+    // increasing
+    bool load_sorted_objs(PyObject *seq, bool check)
+    {
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+        PyObject **items = PySequence_Fast_ITEMS(seq);
+        if (check)
         {
-            Py_XDECREF(*it);
+            for (Py_ssize_t i = 1; i < n; ++i)
+            {
+                if (PyObject_RichCompareBool(items[i - 1], items[i], Py_LT) != 1)
+                    return false;
+            }
         }
-        clear();
+        clear_objs();
+        for (Py_ssize_t i = 0; i < n; ++i)
+        {
+            Py_XINCREF(items[i]);
+        }
+        build_sorted(items, items + n);
+        return true;
     };
     bool pop_first_save_obj(PyObject* &obj)
     {
@@ -62,6 +176,118 @@ public:
     };
 };
 
+// run-length multiset: each node holds one object and the number of
+// times an equal object has been added
+struct pyobjcount
+{
+    pyobjcount() : obj(0), count(0) { };
+    pyobjcount(PyObject *o, size_t c) : obj(o), count(c) { };
+    PyObject *obj;
+    size_t count;
+};
+
+struct pyobjcountcmp
+{
+    bool operator()(const pyobjcount &o1, const pyobjcount &o2) const
+    {
+        return (PyObject_RichCompareBool(o1.obj, o2.obj, Py_LT) == 1);
+    }
+};
+
+struct pyobjcountdispose
+{
+    void operator()(pyobjcount &run) const {Py_XDECREF(run.obj);}
+};
+typedef RedBlackTreeIterator<pyobjcount, pyobjcountcmp> CountRBTreeIterator;
+class CountRBTree : public RedBlackTree<pyobjcount, pyobjcountcmp>
+{
+public:
+    void add_obj(PyObject *obj)
+    {
+        reclaim_step();
+        CountRBTreeIterator found;
+        if (insert(pyobjcount(obj, 1), found))
+            Py_XINCREF(obj);
+        else
+            ++getNode(found)->value.count;
+    };
+    // returns the run holding the object equal to `obj`, or an
+    // invalid iterator if there is none
+    CountRBTreeIterator find_obj(PyObject *obj)
+    {
+        pyobjcount probe(obj, 0);
+        CountRBTreeIterator it = find(probe);
+        if (it.valid() && it.getDir() == 0) return it;
+        return CountRBTreeIterator();
+    };
+    size_t count_obj(PyObject *obj)
+    {
+        CountRBTreeIterator it = find_obj(obj);
+        if (it.valid()) return (*it).count;
+        return 0;
+    };
+    // removes one of the objects equal to `obj`
+    bool del_obj(PyObject *obj)
+    {
+        reclaim_step();
+        pyobjcount probe(obj, 0);
+        CountRBTreeIterator it = find(probe);
+        if (!it.valid() || it.getDir() != 0) return false;
+        if ((*it).count > 1)
+        {
+            --getNode(it)->value.count;
+            return true;
+        }
+        pyobjcount found;
+        if (remove(it, found))
+        {
+            Py_XDECREF(found.obj);
+            return true;
+        }
+        return false;
+    };
+    size_t del_obj_all(PyObject *obj)
+    {
+        pyobjcount probe(obj, 0);
+        pyobjcount found;
+        if (remove(probe, found))
+        {
+            Py_XDECREF(found.obj);
+            return found.count;
+        }
+        return 0;
+    };
+    bool pop_first_save_obj(PyObject* &obj)
+    {
+        CountRBTreeIterator it = begin();
+        if (!it.valid()) return false;
+        if ((*it).count > 1)
+        {
+            --getNode(it)->value.count;
+            obj = (*it).obj;
+            Py_XINCREF(obj);
+            return true;
+        }
+        pyobjcount found;
+        if (remove(it, found))
+        {
+            obj = found.obj;
+            return true;
+        }
+        return false;
+    };
+    void clear_objs()
+    {
+        pyobjcountdispose dispose;
+        Node<pyobjcount> *node = release();
+        destroy(node, (size_t)-1, dispose);
+        drain((size_t)-1, dispose);
+    };
+    void clear_objs_incremental() {detach();};
+    size_t drain_objs(size_t limit) {return drain(limit, pyobjcountdispose());};
+    void reclaim_step() {if (has_detached()) drain_objs(RB_DRAIN_STEP);};
+};
+
 typedef pair<PyObject*,PyObject*> pyobjpair;
 
 // wrappers : (
@@ -77,6 +303,57 @@ typedef struct _pyobjpairw pyobjpairw;
 
 typedef Node<pyobjpairw> PairNode;
 
+// kept at each node of a tree with digests enabled (only those trees
+// allocate the larger nodes): the hash of the (key, value) entry at
+// the node, and the sum of the entry hashes in its subtree.  Both are
+// needed, since a node's own hash cannot be recovered from the
+// digests once rotations have moved its children.
+struct pyobjpairdigest
+{
+    uint64_t hash;
+    uint64_t digest;
+};
+
+// subtree digests are sums of entry hashes, so that equal sets of
+// entries have equal digests whatever the shape of the tree
+template <>
+struct RedBlackAugment<pyobjpairw>
+{
+    typedef pyobjpairdigest Data;
+    static void update(PairNode *node)
+    {
+        uint64_t digest = rb_augment_data(node).hash;
+        if (node->left) digest += rb_augment_data(node->left).digest;
+        if (node->right) digest += rb_augment_data(node->right).digest;
+        rb_augment_data(node).digest = digest;
+    };
+};
+
+// hash of a (key, value) entry for subtree digests; values that
+// cannot be hashed are hashed by identity
+static inline uint64_t
+pyentryhash(PyObject *key, PyObject *value)
+{
+    Py_hash_t key_hash = PyObject_Hash(key);
+    Py_hash_t value_hash = PyObject_Hash(value);
+    if (key_hash == -1 || value_hash == -1)
+    {
+        PyErr_Clear();
+        if (key_hash == -1) key_hash = (Py_hash_t)key;
+        if (value_hash == -1) value_hash = (Py_hash_t)value;
+    }
+    uint64_t x = (uint64_t)key_hash * 0x9e3779b97f4a7c15ULL ^ (uint64_t)value_hash;
+    // splitmix64 step (the offset keeps the entry (0, 0) from
+    // hashing to zero)
+    x += 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
 struct pyobjpaircmp
 {
     bool operator()(const pyobjpairw &o1, const pyobjpairw &o2) const
@@ -85,8 +362,120 @@ struct pyobjpaircmp
     }
 };
 
+struct pyobjpairdispose
+{
+    void operator()(pyobjpairw &item) const
+    {
+        Py_XDECREF(item.first);
+        Py_XDECREF(item.second);
+    }
+};
 typedef RedBlackTreeIterator<pyobjpairw, pyobjpaircmp> PairRBTreeIterator;
 
+// contiguous copy of a sequence of objects for export through the
+// buffer protocol: int64 ('q') if they are all ints that fit, double
+// ('d') if they are all floats, and object references ('O')
+// otherwise
+class PyObjectArray
+{
+public:
+    PyObjectArray() : format("O") { };
+    ~PyObjectArray()
+    {
+        if (this->format[0] == 'O')
+        {
+            for (size_t i = 0; i < this->objects.size(); ++i)
+                Py_XDECREF(this->objects[i]);
+        }
+    };
+    // takes the borrowed references in `objects` and picks the
+    // narrowest format that holds them all
+    void assign(vector<PyObject*> &objects)
+    {
+        this->objects.swap(objects);
+        size_t n = this->objects.size();
+        bool ints = n > 0, floats = n > 0;
+        for (size_t i = 0; i < n && (ints || floats); ++i)
+        {
+            ints = ints && PyLong_CheckExact(this->objects[i]);
+            floats = floats && PyFloat_CheckExact(this->objects[i]);
+        }
+        if (ints)
+        {
+            this->ints.resize(n);
+            for (size_t i = 0; i < n && ints; ++i)
+            {
+                int overflow = 0;
+                this->ints[i] = PyLong_AsLongLongAndOverflow(this->objects[i],
+                                                             &overflow);
+                ints = !overflow;
+            }
+            if (ints)
+            {
+                this->format = "q";
+                this->objects.clear();
+                return;
+            }
+            this->ints.clear();
+        }
+        else if (floats)
+        {
+            this->floats.resize(n);
+            for (size_t i = 0; i < n; ++i)
+                this->floats[i] = PyFloat_AS_DOUBLE(this->objects[i]);
+            this->format = "d";
+            this->objects.clear();
+            return;
+        }
+        for (size_t i = 0; i < n; ++i)
+            Py_XINCREF(this->objects[i]);
+    };
+    const char* getFormat() const {return this->format;};
+    size_t size() const
+    {
+        switch (this->format[0])
+        {
+        case 'q': return this->ints.size();
+        case 'd': return this->floats.size();
+        default: return this->objects.size();
+        }
+    };
+    size_t itemsize() const
+    {
+        switch (this->format[0])
+        {
+        case 'q': return sizeof(int64_t);
+        case 'd': return sizeof(double);
+        default: return sizeof(PyObject*);
+        }
+    };
+    void* data()
+    {
+        if (!size()) return 0;
+        switch (this->format[0])
+        {
+        case 'q': return &this->ints[0];
+        case 'd': return &this->floats[0];
+        default: return &this->objects[0];
+        }
+    };
+    // new reference to element `i`
+    PyObject* item(size_t i) const
+    {
+        switch (this->format[0])
+        {
+        case 'q': return PyLong_FromLongLong(this->ints[i]);
+        case 'd': return PyFloat_FromDouble(this->floats[i]);
+        default: Py_XINCREF(this->objects[i]); return this->objects[i];
+        }
+    };
+private:
+    const char *format;
+    vector<int64_t> ints;
+    vector<double> floats;
+    vector<PyObject*> objects;
+};
+
 #ifdef DEBUG
 string
 pyobjrepr(PyObject *o)
@@ -103,6 +492,7 @@ class PairRBTree : public RedBlackTree<pyobjpairw, pyobjpaircmp>
 public:
     bool del_key(PyObject *key)
     {
+        reclaim_step();
 #ifdef DEBUG
         cout << "del_key begin " << to_string() << endl;
 #endif // DEBUG
@@ -124,6 +514,7 @@ public:
     };
     bool del_key_save_value(PyObject *key, PyObject* &value)
     {
+        reclaim_step();
         pyobjpairw probe(key, Py_None);
         pyobjpairw found;
         if (remove(probe, found))
@@ -134,6 +525,67 @@ public:
         }
         return false;
     }
+    // multimap operations: equal keys may be stored more than once,
+    // and are kept in the order they were added
+    void add_item_multi(PyObject *key, PyObject *value)
+    {
+        reclaim_step();
+        pyobjpairw probe(key, value);
+        uint64_t hash = entry_hash(key, value);
+        PairRBTreeIterator found;
+        insert_multi(probe, found);
+        set_hash(getNode(found), hash);
+        Py_XINCREF(key);
+        Py_XINCREF(value);
+    };
+    PairRBTreeIterator lower_bound_key(PyObject *key)
+    {
+        pyobjpairw probe(key, Py_None);
+        return lower_bound(probe);
+    };
+    PairRBTreeIterator upper_bound_key(PyObject *key)
+    {
+        pyobjpairw probe(key, Py_None);
+        return upper_bound(probe);
+    };
+    size_t count_key(PyObject *key)
+    {
+        size_t count = 0;
+        for (PairRBTreeIterator it = lower_bound_key(key);
+             it.valid() &&
+                 PyObject_RichCompareBool(key, (*it).first, Py_LT) != 1;
+             ++it)
+            ++count;
+        return count;
+    };
+    // removes the first-added of the items with a key equal to `key`
+    bool del_key_first_save_value(PyObject *key, PyObject* &value)
+    {
+        reclaim_step();
+        PairRBTreeIterator it = lower_bound_key(key);
+        if (!it.valid() ||
+            PyObject_RichCompareBool(key, (*it).first, Py_LT) == 1)
+            return false;
+        pyobjpairw found;
+        if (remove(it, found))
+        {
+            Py_XDECREF(found.first);
+            value = found.second;
+            return true;
+        }
+        return false;
+    };
+    size_t del_key_all(PyObject *key)
+    {
+        size_t count = 0;
+        PyObject *value;
+        while (del_key_first_save_value(key, value))
+        {
+            Py_XDECREF(value);
+            ++count;
+        }
+        return count;
+    };
     PyObject* get_value_for_key(PyObject *key, bool &out_found)
     {
 #ifdef DEBUG
@@ -151,14 +603,17 @@ public:
     };
     bool set_key(PyObject *key, PyObject *value)
     {
+        reclaim_step();
 #ifdef DEBUG
         cout << "set_key begin " << to_string() << endl;
 #endif // DEBUG
         pyobjpairw probe(key, value);
+        uint64_t hash = entry_hash(key, value);
         PairRBTreeIterator found;
         if (insert(probe, found))
         {
             // storing a value
+            set_hash(getNode(found), hash);
             Py_XINCREF(key);
             Py_XINCREF(value);
 #ifdef DEBUG
@@ -176,20 +631,451 @@ public:
             Py_XDECREF((*found).second);
             Py_XINCREF(value);
             getNode(found)->value.second = value;
+            set_hash(getNode(found), hash);
 #ifdef DEBUG
             cout << "set_key end " << to_string() << endl;
 #endif // DEBUG
             return false;
         }
     };
-    void clear_objs()
+    // compound operations: each finds or creates the item for `key`
+    // with a single descent and updates its value in place.  They
+    // return a borrowed reference to the value now stored for `key`,
+    // or NULL if a Python exception was raised; `out_inserted` tells
+    // whether a new item was created.
+
+    // returns the value for `key`, first storing `dflt` if there is
+    // none
+    PyObject* setdefault_key(PyObject *key, PyObject *dflt,
+                             bool &out_inserted)
     {
+        reclaim_step();
+        pyobjpairw probe(key, dflt);
+        uint64_t hash = entry_hash(key, dflt);
+        PairRBTreeIterator it = find(probe);
+        out_inserted = !(it.valid() && it.getDir() == 0);
+        if (!out_inserted) return (*it).second;
+        Py_XINCREF(key);
+        Py_XINCREF(dflt);
+        set_hash(insert_at(it, probe), hash);
+        return dflt;
+    };
+    // returns the value for `key`, first storing `factory()` if there
+    // is none
+    PyObject* get_or_insert_key(PyObject *key, PyObject *factory,
+                                bool &out_inserted)
+    {
+        reclaim_step();
+        pyobjpairw probe(key, Py_None);
+        PairRBTreeIterator it = find(probe);
+        out_inserted = false;
+        if (it.valid() && it.getDir() == 0) return (*it).second;
+        unsigned long version = getVersion();
+        PyObject *value = PyObject_CallObject(factory, NULL);
+        if (!value) return NULL;
+        probe.second = value;
+        uint64_t hash = entry_hash(key, value);
+        if (getVersion() != version)
+        {
+            // the factory changed the tree; search again
+            it = find(probe);
+            if (it.valid() && it.getDir() == 0)
+            {
+                Py_DECREF(value);
+                return (*it).second;
+            }
+        }
+        // the new reference to value is handed to the tree
+        Py_XINCREF(key);
+        set_hash(insert_at(it, probe), hash);
+        out_inserted = true;
+        return value;
+    };
+    // stores `fn(old)` for `key`, where `old` is the current value or
+    // `dflt` if there is none
+    PyObject* update_key_with(PyObject *key, PyObject *fn, PyObject *dflt,
+                              bool &out_inserted)
+    {
+        return _update_key(key, fn, dflt, false, out_inserted);
+    };
+    // stores `old + delta` for `key`, where `old` is the current
+    // value or `dflt` if there is none
+    PyObject* increment_key(PyObject *key, PyObject *delta, PyObject *dflt,
+                            bool &out_inserted)
+    {
+        return _update_key(key, delta, dflt, true, out_inserted);
+    };
+    // as set_key, for a dictionary that holds at most `maxlen` items,
+    // of which there are currently `size`; see
+    // ObjectRBTree::add_obj_bounded.  A key equal to the one that
+    // would be evicted has its value overwritten.  Returns true if the
+    // dictionary grew.
+    bool set_key_bounded(PyObject *key, PyObject *value, size_t size,
+                         size_t maxlen, bool evict_max)
+    {
+        if (maxlen == 0) return false;
+        if (size >= maxlen &&
+            PyObject_RichCompareBool(key, (*(evict_max ? last() : begin())).first,
+                                     evict_max ? Py_GT : Py_LT) == 1)
+            return false;
+        if (!set_key(key, value)) return false;
+        if (size < maxlen) return true;
+        PairRBTreeIterator it = evict_max ? last() : begin();
+        pyobjpairw found;
+        if (remove(it, found))
+        {
+            Py_XDECREF(found.first);
+            Py_XDECREF(found.second);
+        }
+        return false;
+    };
+private:
+    PyObject* _update_key(PyObject *key, PyObject *arg, PyObject *dflt,
+                          bool add, bool &out_inserted)
+    {
+        reclaim_step();
+        pyobjpairw probe(key, Py_None);
+        PairRBTreeIterator it = find(probe);
+        bool found = (it.valid() && it.getDir() == 0);
+        // keep the old value alive in case user code removes it
+        PyObject *old = found ? (*it).second : dflt;
+        Py_XINCREF(old);
+        unsigned long version = getVersion();
+        PyObject *value = (add ? PyNumber_Add(old, arg) :
+                           PyObject_CallFunctionObjArgs(arg, old, NULL));
+        Py_XDECREF(old);
+        out_inserted = false;
+        if (!value) return NULL;
+        probe.second = value;
+        uint64_t hash = entry_hash(key, value);
+        if (getVersion() != version)
+        {
+            // user code changed the tree; search again
+            it = find(probe);
+            found = (it.valid() && it.getDir() == 0);
+        }
+        // the new reference to value is handed to the tree
+        if (found)
+        {
+            PyObject *prev = (*it).second;
+            getNode(it)->value.second = value;
+            set_hash(getNode(it), hash);
+            Py_XDECREF(prev);
+        }
+        else
+        {
+            Py_XINCREF(key);
+            set_hash(insert_at(it, probe), hash);
+            out_inserted = true;
+        }
+        return value;
+    };
+    // the hash of the entry (key, value) if the tree keeps digests;
+    // this may run user code, so it is taken before searching the
+    // tree
+    uint64_t entry_hash(PyObject *key, PyObject *value)
+    {
+        return is_augmented() ? pyentryhash(key, value) : 0;
+    };
+    // stores the entry hash of `node`, which is linked into the tree,
+    // and brings the digests above it up to date
+    void set_hash(PairNode *node, uint64_t hash)
+    {
+        if (!is_augmented()) return;
+        rb_augment_data(node).hash = hash;
+        augment_path(node);
+    };
+    // stores the entry hashes of all of the nodes, in key order, and
+    // brings the digests up to date
+    void set_hashes(const vector<uint64_t> &hashes)
+    {
+        size_t i = 0;
+        for (PairRBTreeIterator it = begin(); it.valid(); ++it)
+            rb_augment_data(getNode(it)).hash = hashes[i++];
+        set_augmented(true);
+    };
+    // the highest node with a key in the open range (lo, hi), where
+    // NULL means no bound
+    PairNode* split_node(PyObject *lo, PyObject *hi)
+    {
+        PairNode *node = getRoot();
+        while (node)
+        {
+            if (lo && PyObject_RichCompareBool(lo, node->value.first, Py_LT) != 1)
+                node = node->right;
+            else if (hi && PyObject_RichCompareBool(node->value.first, hi,
+                                                    Py_LT) != 1)
+                node = node->left;
+            else
+                return node;
+        }
+        return 0;
+    };
+public:
+    // subtree digests: once switched on, every node holds the sum of
+    // the hashes of the (key, value) entries in its subtree, which is
+    // kept up to date by inserts, removals, overwrites and rotations
+    void enable_digests()
+    {
+        if (is_augmented()) return;
+        vector<uint64_t> hashes;
         for (PairRBTreeIterator it = begin(); it != end(); ++it)
+            hashes.push_back(pyentryhash((*it).first, (*it).second));
+        set_augmented(true);
+        set_hashes(hashes);
+    };
+    bool digests_enabled() const {return is_augmented();};
+    // sum of the hashes of the entries with keys below `key` (or not
+    // above it, with `inclusive`); NULL means no bound
+    uint64_t prefix_digest(PyObject *key, bool inclusive)
+    {
+        PairNode *node = getRoot();
+        if (!is_augmented()) return 0;
+        if (!key) return node ? rb_augment_data(node).digest : 0;
+        uint64_t digest = 0;
+        while (node)
+        {
+            bool below = (inclusive ?
+                          PyObject_RichCompareBool(key, node->value.first, Py_LT) != 1 :
+                          PyObject_RichCompareBool(node->value.first, key, Py_LT) == 1);
+            if (below)
+            {
+                digest += rb_augment_data(node).hash;
+                if (node->left) digest += rb_augment_data(node->left).digest;
+                node = node->right;
+            }
+            else node = node->left;
+        }
+        return digest;
+    };
+    // digest of the entries with `lo <= key < hi`, in O(log n)
+    uint64_t range_digest(PyObject *lo, PyObject *hi)
+    {
+        return prefix_digest(hi, false) - (lo ? prefix_digest(lo, false) : 0);
+    };
+    // appends to the list `out`, in order, the keys in the open range
+    // (lo, hi) that are in only one of this tree and `other` or that
+    // map to unequal values.  Ranges whose digests agree are skipped
+    // without being visited, so the cost grows with the number of
+    // differences rather than the size of the trees.  Both trees must
+    // keep digests.  Returns 0, or -1 with a Python exception set if
+    // `out` could not be extended.
+    int diff_keys(PairRBTree *other, PyObject *lo, PyObject *hi,
+                  PyObject *out)
+    {
+        uint64_t mine = (prefix_digest(hi, false) -
+                         (lo ? prefix_digest(lo, true) : 0));
+        uint64_t theirs = (other->prefix_digest(hi, false) -
+                           (lo ? other->prefix_digest(lo, true) : 0));
+        if (mine == theirs) return 0;
+        PairNode *split = split_node(lo, hi);
+        if (!split) split = other->split_node(lo, hi);
+        if (!split) return 0;
+        // hold on to the key in case comparing values runs code that
+        // changes the trees
+        PyObject *key = split->value.first;
+        Py_INCREF(key);
+        if (diff_keys(other, lo, key, out) < 0)
+        {
+            Py_DECREF(key);
+            return -1;
+        }
+        pyobjpairw probe(key, Py_None);
+        PairRBTreeIterator a = find(probe);
+        PairRBTreeIterator b = other->find(probe);
+        bool in_a = a.valid() && a.getDir() == 0;
+        bool in_b = b.valid() && b.getDir() == 0;
+        // entry hashes may differ for equal values (those hashed by
+        // identity, or with a hash inconsistent with ==), so values
+        // are always compared
+        bool same = in_a && in_b;
+        if (same && (*a).second != (*b).second)
+        {
+            int eq = PyObject_RichCompareBool((*a).second, (*b).second, Py_EQ);
+            if (eq < 0) PyErr_Clear();
+            same = (eq == 1);
+        }
+        int rv = 0;
+        if (!same) rv = PyList_Append(out, key);
+        if (rv == 0) rv = diff_keys(other, key, hi, out);
+        Py_DECREF(key);
+        return rv < 0 ? -1 : 0;
+    };
+    // fills `out` with the keys (or with `values`, the values) of
+    // the items with `lo <= key < hi`, where NULL means no bound
+    void export_range(PyObject *lo, PyObject *hi, bool values,
+                      PyObjectArray &out)
+    {
+        vector<PyObject*> objects;
+        PairRBTreeIterator it = lo ? lower_bound_key(lo) : begin();
+        for (; it.valid(); ++it)
+        {
+            if (hi && PyObject_RichCompareBool((*it).first, hi, Py_LT) != 1)
+                break;
+            objects.push_back(values ? (*it).second : (*it).first);
+        }
+        out.assign(objects);
+    };
+    // applies a batch of writes, where `keys` is a list of distinct
+    // keys in sorted order and `values` holds the value to store for
+    // each, or `deleted` to remove it.  `size` is the number of items
+    // in the tree.  A batch that is small next to the tree is applied
+    // one item at a time in key order, each search starting from the
+    // previous item (a finger search); a larger one is merged with the
+    // contents of the tree and the tree rebuilt in O(n + m).  Returns
+    // the change in the number of items.
+    Py_ssize_t apply_sorted(PyObject *keys, PyObject *values,
+                            PyObject *deleted, size_t size)
+    {
+        Py_ssize_t m = PySequence_Fast_GET_SIZE(keys);
+        PyObject **key_items = PySequence_Fast_ITEMS(keys);
+        PyObject **value_items = PySequence_Fast_ITEMS(values);
+        Py_ssize_t delta = 0;
+        // references dropped by the batch are released only once the
+        // tree is whole again
+        vector<PyObject*> garbage;
+        if ((size_t)m * 4 < size)
+        {
+            PairRBTreeIterator hint;
+            for (Py_ssize_t i = 0; i < m; ++i)
+            {
+                pyobjpairw probe(key_items[i], value_items[i]);
+                uint64_t hash = (probe.second == deleted ? 0 :
+                                 entry_hash(probe.first, probe.second));
+                PairRBTreeIterator it = find_near(hint, probe);
+                bool found = (it.valid() && it.getDir() == 0);
+                if (probe.second == deleted)
+                {
+                    // the hint may be freed
+                    hint = PairRBTreeIterator();
+                    pyobjpairw old;
+                    if (found && remove(it, old))
+                    {
+                        garbage.push_back(old.first);
+                        garbage.push_back(old.second);
+                        --delta;
+                    }
+                    continue;
+                }
+                Py_XINCREF(probe.second);
+                if (found)
+                {
+                    garbage.push_back((*it).second);
+                    getNode(it)->value.second = probe.second;
+                    set_hash(getNode(it), hash);
+                    hint = it;
+                }
+                else
+                {
+                    Py_XINCREF(probe.first);
+                    hint = PairRBTreeIterator(insert_at(it, probe), 0);
+                    set_hash(getNode(hint), hash);
+                    ++delta;
+                }
+            }
+            for (size_t j = 0; j < garbage.size(); ++j)
+                Py_XDECREF(garbage[j]);
+            return delta;
+        }
+        vector<pyobjpairw> items;
+        items.reserve(size + m);
+        // entry hashes of `items`, if the tree keeps digests
+        vector<uint64_t> hashes;
+        PairRBTreeIterator it = begin();
+        Py_ssize_t i = 0;
+        while (it.valid() || i < m)
         {
-            Py_XDECREF((*it).first);
-            Py_XDECREF((*it).second);
+            int order = (!it.valid() ? 1 : i >= m ? -1 :
+                         PyObject_RichCompareBool((*it).first, key_items[i],
+                                                  Py_LT) == 1 ? -1 :
+                         PyObject_RichCompareBool(key_items[i], (*it).first,
+                                                  Py_LT) == 1 ? 1 : 0);
+            if (order < 0)
+            {
+                items.push_back(*it);
+                if (is_augmented())
+                    hashes.push_back(rb_augment_data(getNode(it)).hash);
+                ++it;
+                continue;
+            }
+            PyObject *key = key_items[i];
+            PyObject *value = value_items[i];
+            ++i;
+            if (order == 0)
+            {
+                pyobjpairw &old = *it;
+                ++it;
+                garbage.push_back(old.second);
+                if (value == deleted)
+                {
+                    garbage.push_back(old.first);
+                    --delta;
+                    continue;
+                }
+                key = old.first;
+            }
+            else
+            {
+                if (value == deleted) continue;
+                Py_XINCREF(key);
+                ++delta;
+            }
+            Py_XINCREF(value);
+            items.push_back(pyobjpairw(key, value));
+            if (is_augmented()) hashes.push_back(pyentryhash(key, value));
         }
-        clear();
+        // the old nodes are freed without touching their payloads,
+        // which now belong to `items`
+        build_sorted(items.begin(), items.end());
+        if (is_augmented()) set_hashes(hashes);
+        for (size_t j = 0; j < garbage.size(); ++j)
+            Py_XDECREF(garbage[j]);
+        return delta;
+    };
+    void clear_objs()
+    {
+        pyobjpairdispose dispose;
+        PairNode *node = release();
+        destroy(node, (size_t)-1, dispose);
+        drain((size_t)-1, dispose);
+    };
+    void clear_objs_incremental() {detach();};
+    size_t drain_objs(size_t limit) {return drain(limit, pyobjpairdispose());};
+    void reclaim_step() {if (has_detached()) drain_objs(RB_DRAIN_STEP);};
+    // replaces the contents of the tree with the keys in `keys`
+    // and the corresponding values in `values` (lists or tuples of
+    // the same length) in O(n); if `check` is set, returns false
+    // without changing anything unless the keys are strictly
+    // increasing
+    bool load_sorted_items(PyObject *keys, PyObject *values, bool check)
+    {
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(keys);
+        PyObject **key_items = PySequence_Fast_ITEMS(keys);
+        PyObject **value_items = PySequence_Fast_ITEMS(values);
+        if (check)
+        {
+            for (Py_ssize_t i = 1; i < n; ++i)
+            {
+                if (PyObject_RichCompareBool(key_items[i - 1], key_items[i],
+                                             Py_LT) != 1)
+                    return false;
+            }
+        }
+        clear_objs();
+        vector<pyobjpairw> items;
+        vector<uint64_t> hashes;
+        items.reserve(n);
+        for (Py_ssize_t i = 0; i < n; ++i)
+        {
+            Py_XINCREF(key_items[i]);
+            Py_XINCREF(value_items[i]);
+            items.push_back(pyobjpairw(key_items[i], value_items[i]));
+            if (is_augmented())
+                hashes.push_back(pyentryhash(key_items[i], value_items[i]));
+        }
+        build_sorted(items.begin(), items.end());
+        if (is_augmented()) set_hashes(hashes);
+        return true;
     };
     bool pop_first_save_item(PyObject* &key, PyObject* &value)
     {
@@ -225,4 +1111,73 @@ RedBlackTree<pyobjpairw, pyobjpaircmp>::_to_string(PairNode *node)
 };
 #endif // DEBUG
 
+// k-way merges over several sets or dictionaries; `lo` and `hi` are
+// NULL for an unbounded range
+class ObjectRBMerge : public RedBlackMerge<PyObject*, pyobjcmp>
+{
+public:
+    ObjectRBMerge(bool dedupe, bool reverse)
+        : RedBlackMerge<PyObject*, pyobjcmp>(dedupe, reverse) { };
+    void add_tree(ObjectRBTree *tree, PyObject *lo, PyObject *hi)
+    {
+        add(*tree, lo ? &lo : 0, hi ? &hi : 0);
+    };
+    // sets `obj` to a borrowed reference to the next object
+    bool next_obj(PyObject* &obj)
+    {
+        if (!valid()) return false;
+        obj = **this;
+        ++(*this);
+        return true;
+    };
+    // replaces the contents of `tree` with the rest of the merge in
+    // O(n), keeping the first of each run of equal objects; returns
+    // the number of objects stored
+    size_t drain_into(ObjectRBTree *tree, bool reverse)
+    {
+        vector<PyObject*> items;
+        drain_unique(items);
+        if (reverse) std::reverse(items.begin(), items.end());
+        tree->clear_objs();
+        for (size_t i = 0; i < items.size(); ++i)
+            Py_XINCREF(items[i]);
+        return tree->build_sorted(items.begin(), items.end());
+    };
+};
+
+class PairRBMerge : public RedBlackMerge<pyobjpairw, pyobjpaircmp>
+{
+public:
+    PairRBMerge(bool dedupe, bool reverse)
+        : RedBlackMerge<pyobjpairw, pyobjpaircmp>(dedupe, reverse) { };
+    void add_tree(PairRBTree *tree, PyObject *lo, PyObject *hi)
+    {
+        pyobjpairw lo_probe(lo, Py_None);
+        pyobjpairw hi_probe(hi, Py_None);
+        add(*tree, lo ? &lo_probe : 0, hi ? &hi_probe : 0);
+    };
+    // sets `key` and `value` to borrowed references to the next item
+    bool next_item(PyObject* &key, PyObject* &value)
+    {
+        if (!valid()) return false;
+        key = (**this).first;
+        value = (**this).second;
+        ++(*this);
+        return true;
+    };
+    size_t drain_into(PairRBTree *tree, bool reverse)
+    {
+        vector<pyobjpairw> items;
+        drain_unique(items);
+        if (reverse) std::reverse(items.begin(), items.end());
+        tree->clear_objs();
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            Py_XINCREF(items[i].first);
+            Py_XINCREF(items[i].second);
+        }
+        return tree->build_sorted(items.begin(), items.end());
+    };
+};
+
 #endif /* _PYREDBLACK_H_ */
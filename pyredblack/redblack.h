@@ -5,19 +5,62 @@
 //#include <exception>
 #include <assert.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <type_traits>
+#include <stdint.h>
 using namespace std;
 
 // http://stackoverflow.com/a/5590404/1062499
 #include <sstream>
 #define SSTR( x ) dynamic_cast< std::ostringstream & >(     \
-        ( std::ostringstream() << std::dec << x ) ).str()
+        ( std::ostringstream().flush() << std::dec << x ) ).str()
 
+// Operation counters are only compiled in when REDBLACK_STATS is
+// defined; otherwise RB_STAT expands to a no-op.
+#ifdef REDBLACK_STATS
+#define RB_STAT( x ) (x)
+#else
+#define RB_STAT( x ) ((void)0)
+#endif // REDBLACK_STATS
+
+struct RedBlackTreeStats
+{
+    RedBlackTreeStats() : comparisons(0), left_rotations(0),
+                          right_rotations(0), nodes(0), max_depth(0),
+                          avg_depth(0.0)
+    {
+        for (int i = 0; i < 6; ++i) insert_cases[i] = 0;
+        for (int i = 0; i < 7; ++i) remove_cases[i] = 0;
+    };
+
+    // counters (always zero unless compiled with REDBLACK_STATS)
+    unsigned long comparisons;
+    unsigned long left_rotations;
+    unsigned long right_rotations;
+    // insert fixup iterations by case (1-5; 0 unused)
+    unsigned long insert_cases[6];
+    // remove fixup iterations by case (1-6; 0 counts removals of a
+    // red node, which need no fixup)
+    unsigned long remove_cases[7];
+
+    // shape of the tree, computed when the stats are requested
+    size_t nodes;
+    size_t max_depth;
+    double avg_depth;
+    // depth_histogram[d] is the number of nodes at depth d (the root
+    // is at depth 0)
+    vector<size_t> depth_histogram;
+};
+
+// Nodes do not own their children: deleting a node frees just that
+// node, and whole subtrees are freed by RedBlackTree::destroy.
 template <typename Type>
 class Node
 {
 public:
     Node(Type val);
-    virtual ~Node();
 
     Type value;
     Node *left;
@@ -29,6 +72,104 @@ public:
 template <typename Type, typename Comp = std::less< Type > >
 class RedBlackTree;
 
+// Links and values that may be published to ConcurrentRedBlackTree's
+// lock-free readers are stored atomically, to match the readers'
+// atomic loads: links with release stores, so that a reader that
+// follows a link also sees the node it leads to initialised, and
+// values with relaxed stores.  On x86 all of these compile to
+// ordinary moves.
+
+// copies `n` bytes from `src` to `dst` as Words, each loaded and
+// stored with relaxed atomics
+#define RB_RELAXED_COPY(Word, dst, src, n)                              \
+    do {                                                                \
+        typedef Word __attribute__((may_alias)) word;                   \
+        const word *from = (const word*)(src);                          \
+        word *to = (word*)(dst);                                        \
+        for (size_t i = 0; i < (n) / sizeof(word); ++i)                 \
+            __atomic_store_n(to + i,                                    \
+                             __atomic_load_n(from + i, __ATOMIC_RELAXED), \
+                             __ATOMIC_RELAXED);                         \
+    } while (0)
+
+// assigns `src` to `dst`, in the widest words that the size and
+// alignment of Type allow if it is trivially copyable; a racing
+// reader may see a torn value, but never a data race
+template <typename Type>
+static inline void rb_relaxed_copy(Type &dst, const Type &src)
+{
+    if (!std::is_trivially_copyable<Type>::value)
+        dst = src;
+    else if (sizeof(Type) % 8 == 0 && alignof(Type) >= 8)
+        RB_RELAXED_COPY(uint64_t, &dst, &src, sizeof(Type));
+    else if (sizeof(Type) % 4 == 0 && alignof(Type) >= 4)
+        RB_RELAXED_COPY(uint32_t, &dst, &src, sizeof(Type));
+    else if (sizeof(Type) % 2 == 0 && alignof(Type) >= 2)
+        RB_RELAXED_COPY(uint16_t, &dst, &src, sizeof(Type));
+    else
+        RB_RELAXED_COPY(uint8_t, &dst, &src, sizeof(Type));
+}
+
+template <typename Type>
+static inline void rb_store_link(Node<Type>* &link, Node<Type> *node)
+{
+    __atomic_store_n(&link, node, __ATOMIC_RELEASE);
+}
+
+// Augmentation hook.  Trees with augmentation switched on allocate
+// their nodes as AugmentedNodes, which carry a
+// RedBlackAugment<Type>::Data (value-initialised) next to the value,
+// and call RedBlackAugment<Type>::update(node) whenever the contents
+// of the subtree under `node` change (children before parents), so
+// that a node can cache a summary of its subtree in its Data; see
+// the specialisation for pyobjpairw in pyredblack.h.  Trees without
+// augmentation allocate plain Nodes.  The default does nothing.
+template <typename Type>
+struct RedBlackAugment
+{
+    struct Data { };
+    static void update(Node<Type> *node) { };
+};
+
+template <typename Type>
+class AugmentedNode : public Node<Type>
+{
+public:
+    typedef typename RedBlackAugment<Type>::Data Data;
+    // nodes of both kinds are freed by rb_delete_node, which only
+    // runs Node's destructor
+    static_assert(std::is_trivially_destructible<Data>::value,
+                  "augmentation data must be trivially destructible");
+    AugmentedNode(Type val) : Node<Type>(val), data() { };
+
+    Data data;
+};
+
+// the augmentation data of a node of a tree with augmentation on
+template <typename Type>
+static inline typename RedBlackAugment<Type>::Data&
+rb_augment_data(Node<Type> *node)
+{
+    return static_cast<AugmentedNode<Type>*>(node)->data;
+}
+
+// frees a node allocated as either a Node or an AugmentedNode
+template <typename Type>
+static inline void rb_delete_node(Node<Type> *node)
+{
+    node->~Node<Type>();
+    ::operator delete(node);
+}
+
+// Disposal hook for RedBlackTree::destroy and drain, called on the
+// value of each node just before the node is freed.  The default
+// leaves the value alone.
+template <typename Type>
+struct RedBlackNoDispose
+{
+    void operator()(Type &value) const { };
+};
+
 template <typename Type, typename Comp = std::less< Type > >
 class RedBlackTreeIterator
 {
@@ -41,6 +182,7 @@ public:
 
     RedBlackTreeIterator<Type, Comp>& operator=(const RedBlackTreeIterator<Type, Comp>&);
     RedBlackTreeIterator<Type, Comp>& operator++();
+    RedBlackTreeIterator<Type, Comp>& operator--();
     Type& operator*() const;
     bool operator==(const RedBlackTreeIterator<Type, Comp>&);
     bool operator!=(const RedBlackTreeIterator<Type, Comp>&);
@@ -62,12 +204,34 @@ public:
     virtual ~RedBlackTree();
 
     RedBlackTreeIterator<Type, Comp> find(Type &in_Value) const;
+    RedBlackTreeIterator<Type, Comp> find_near(const RedBlackTreeIterator<Type, Comp> &hint,
+                                               Type &in_Value) const;
+    RedBlackTreeIterator<Type, Comp> lower_bound(Type &in_Value) const;
+    RedBlackTreeIterator<Type, Comp> upper_bound(Type &in_Value) const;
     bool insert(Type value, RedBlackTreeIterator<Type, Comp> &out_Value);
+    void insert_multi(Type value, RedBlackTreeIterator<Type, Comp> &out_Value);
     bool remove(Type value, Type &out_Value);
     void clear();
+    // empties the tree in O(1), leaving its nodes to be freed by drain
+    void detach();
+    template <typename Dispose>
+    size_t drain(size_t limit, Dispose dispose);
+    size_t drain(size_t limit = (size_t)-1)
+    {return drain(limit, RedBlackNoDispose<Type>());};
+    bool has_detached() const {return !this->detached.empty();};
+
+    template <typename Iter>
+    size_t build(Iter first, Iter last, unsigned threads = 1);
+    template <typename Iter>
+    size_t build_sorted(Iter first, Iter last, unsigned threads = 1);
+
+    RedBlackTreeIterator<Type, Comp> begin() const;
+    RedBlackTreeIterator<Type, Comp> last() const;
+    RedBlackTreeIterator<Type, Comp> end() const;
 
-    RedBlackTreeIterator<Type, Comp> begin();
-    RedBlackTreeIterator<Type, Comp> end();
+    static bool stats_enabled();
+    void get_stats(RedBlackTreeStats &out) const;
+    void reset_stats();
 
 #ifdef DEBUG
     string to_string();
@@ -75,17 +239,69 @@ public:
 protected:
     Node<Type>* getNode(RedBlackTreeIterator<Type, Comp> &it) const
     {return it.getNode();};
+    Node<Type>* getRoot() const {return this->root;};
+    // the root link itself, for readers that must load it atomically
+    Node<Type>* const& getRootLink() const {return this->root;};
+    // incremented whenever nodes are linked into or unlinked from the
+    // tree, so that a position found before calling out to user code
+    // can be checked for staleness afterwards
+    unsigned long getVersion() const {return this->version;};
+    // switches augmentation (see RedBlackAugment) on or off, moving
+    // every node into a newly allocated node of the right kind if it
+    // changes, and with augmentation on brings every node up to date;
+    // both take O(n)
+    void set_augmented(bool augmented);
+    bool is_augmented() const {return this->augmented;};
+    // updates the augmentation of `node` and each of its ancestors,
+    // after the value at `node` has been changed in place
+    void augment_path(Node<Type> *node);
     bool remove(RedBlackTreeIterator<Type, Comp> &it, Type &out_Value);
+    Node<Type>* insert_at(RedBlackTreeIterator<Type, Comp> &it, Type value);
+    void insert_node(Node<Type> *parent, int dir, Node<Type> *node);
+    // allocates an unlinked node of the kind the tree uses
+    Node<Type>* new_node(const Type &value) const
+    {
+        if (this->augmented) return new AugmentedNode<Type>(value);
+        return new Node<Type>(value);
+    };
+    // called whenever a node (and the subtree hanging off it) is
+    // unlinked from the tree; subclasses may defer the deallocation
+    virtual void free_node(Node<Type> *node) {free_subtree(node);};
+    // unlinks the whole tree and returns its root
+    Node<Type>* release();
+    template <typename Dispose>
+    static size_t destroy(Node<Type>* &node, size_t limit, Dispose &dispose);
+    static void free_subtree(Node<Type> *node)
+    {
+        RedBlackNoDispose<Type> dispose;
+        destroy(node, (size_t)-1, dispose);
+    };
 
 private:
 #ifdef DEBUG
     string _to_string(Node<Type> *node);
 #endif // DEBUG
+    RedBlackTreeIterator<Type, Comp> _find(Node<Type> *current,
+                                           Type &in_Value) const;
     void left_rotate(Node<Type> *node);
     void right_rotate(Node<Type> *node);
+    void reallocate_nodes();
+    template <typename Iter>
+    Node<Type>* _build(Iter first, size_t lo, size_t hi, size_t depth,
+                       size_t red_depth, unsigned threads);
 
     Node<Type> *root;
+    // cached first and last nodes in order (0 when empty)
+    Node<Type> *leftmost;
+    Node<Type> *rightmost;
+    // subtrees unlinked by detach, waiting to be freed by drain
+    vector<Node<Type>*> detached;
+    unsigned long version;
+    bool augmented;
     Comp comp;
+#ifdef REDBLACK_STATS
+    mutable RedBlackTreeStats stats;
+#endif // REDBLACK_STATS
 };
 
 // ======================================================================
@@ -95,20 +311,13 @@ private:
 template <typename Type>
 Node<Type>::Node(Type val)
 {
-    this->value = val;
-    this->left = 0;
-    this->right = 0;
+    rb_relaxed_copy(this->value, val);
+    rb_store_link(this->left, (Node<Type>*)0);
+    rb_store_link(this->right, (Node<Type>*)0);
     this->parent = 0;
     this->red = true;
 }
 
-template <typename Type>
-Node<Type>::~Node()
-{
-    if (this->left) delete this->left;
-    if (this->right) delete this->right;
-}
-
 
 // ======================================================================
 //  ITERATOR
@@ -182,6 +391,36 @@ RedBlackTreeIterator<Type, Comp>::operator++()
     return *this;
 }
 
+// steps to the previous value; stepping back from begin() gives an
+// invalid iterator (equal to end())
+template <typename Type, typename Comp>
+RedBlackTreeIterator<Type, Comp>&
+RedBlackTreeIterator<Type, Comp>::operator--()
+{
+    if (!this->current)
+        throw exception();
+
+    if (this->current->left)
+    {
+        this->current = this->current->left;
+        while (this->current->right)
+            this->current = this->current->right;
+        return *this;
+    }
+    while (this->current->parent)
+    {
+        if (this->current == this->current->parent->right)
+        {
+            this->current = this->current->parent;
+            return *this;
+        }
+        this->current = this->current->parent;
+    }
+    // iterator is over
+    this->current = 0;
+    return *this;
+}
+
 template <typename Type, typename Comp>
 Type&
 RedBlackTreeIterator<Type, Comp>::operator*() const
@@ -217,12 +456,17 @@ template <typename Type, typename Comp>
 RedBlackTree<Type, Comp>::RedBlackTree()
 {
     this->root = 0;
+    this->leftmost = 0;
+    this->rightmost = 0;
+    this->version = 0;
+    this->augmented = false;
 }
 
 template <typename Type, typename Comp>
 RedBlackTree<Type, Comp>::~RedBlackTree()
 {
-    if (this->root) delete this->root;
+    drain();
+    free_subtree(this->root);
 }
 
 /**
@@ -237,9 +481,50 @@ template <typename Type, typename Comp>
 RedBlackTreeIterator<Type, Comp>
 RedBlackTree<Type, Comp>::find ( Type &in_Value ) const
 {
-    Node<Type> *current = this->root;
+    return _find(this->root, in_Value);
+}
+
+/**
+ * As find(), but starts from `hint` (a valid iterator into the tree)
+ * instead of the root.  For a value just above the hint, such as the
+ * next of a run of values inserted in ascending order, this takes
+ * O(log d) comparisons, where d is the number of values between the
+ * two, rather than O(log n).
+ */
+template <typename Type, typename Comp>
+RedBlackTreeIterator<Type, Comp>
+RedBlackTree<Type, Comp>::find_near(const RedBlackTreeIterator<Type, Comp> &hint,
+                                    Type &in_Value) const
+{
+    Node<Type> *current = hint.getNode();
+    RB_STAT(++this->stats.comparisons);
+    if (!current || !comp(current->value, in_Value))
+        return find(in_Value);
+    // climb until the value must lie in the subtree under current:
+    // a right child's parent is below the hint and so below the
+    // value; a left child's parent bounds the subtree from above
+    while (current->parent)
+    {
+        if (current == current->parent->left)
+        {
+            RB_STAT(++this->stats.comparisons);
+            if (comp(in_Value, current->parent->value)) break;
+            RB_STAT(++this->stats.comparisons);
+            if (!comp(current->parent->value, in_Value))
+                return RedBlackTreeIterator<Type, Comp>(current->parent, 0);
+        }
+        current = current->parent;
+    }
+    return _find(current, in_Value);
+}
+
+template <typename Type, typename Comp>
+RedBlackTreeIterator<Type, Comp>
+RedBlackTree<Type, Comp>::_find(Node<Type> *current, Type &in_Value) const
+{
     while (current)
     {
+        RB_STAT(++this->stats.comparisons);
         if (comp(in_Value, current->value))
         {
             if (current->left)
@@ -249,7 +534,8 @@ RedBlackTree<Type, Comp>::find ( Type &in_Value ) const
                 return RedBlackTreeIterator<Type, Comp>(current, -1);
             }
         }
-        else if (comp(current->value, in_Value))
+        else if (RB_STAT(++this->stats.comparisons),
+                 comp(current->value, in_Value))
         {
             if (current->right)
                 current = current->right;
@@ -278,34 +564,110 @@ bool
 RedBlackTree<Type, Comp>::insert(Type value,
                                  RedBlackTreeIterator<Type, Comp> &out_Value)
 {
-    Node<Type> *pNewNode = new Node<Type>(value);
     RedBlackTreeIterator<Type, Comp> it = find(value);
-    Node<Type> *current = it.getNode();
-    if (!current)
-    {
-        this->root = pNewNode;
-        this->root->red = false;
-        out_Value = RedBlackTreeIterator<Type, Comp>(pNewNode, 0);
-        return true;
-    }
-    if (it.getDir() == 0)
+    if (it.valid() && it.getDir() == 0)
     {
         // tree already contains the value, quit now
-        delete pNewNode;
-        out_Value = RedBlackTreeIterator<Type, Comp>(current, 0);
+        out_Value = it;
         return false;
     }
+    out_Value = RedBlackTreeIterator<Type, Comp>(insert_at(it, value), 0);
+    return true;
+}
+
+/**
+ * Inserts a new node with the given value at the position where a
+ * call to find() stopped without finding it, saving a second descent
+ * when the caller needs to look at the tree before deciding to
+ * insert.  The tree must not have been modified since the call to
+ * find().
+ *
+ * \param it the result of find(value), with getDir() != 0
+ * \param value the value to store
+ * \return the new node
+ */
+template <typename Type, typename Comp>
+Node<Type>*
+RedBlackTree<Type, Comp>::insert_at(RedBlackTreeIterator<Type, Comp> &it,
+                                    Type value)
+{
+    Node<Type> *pNewNode = new_node(value);
+    insert_node(it.getNode(), it.getDir(), pNewNode);
+    return pNewNode;
+}
+
+/**
+ * Inserts a new node with the given value into the tree, even if
+ * the tree already contains equal values.  The new node is placed
+ * after all of the values equal to it, so that equal values are
+ * kept in insertion order.
+ *
+ * \param value the value to store
+ * \param out_Value set to point at the new node
+ */
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::insert_multi(Type value,
+                                       RedBlackTreeIterator<Type, Comp> &out_Value)
+{
+    Node<Type> *parent = 0;
+    Node<Type> *current = this->root;
+    int dir = 0;
+    while (current)
+    {
+        parent = current;
+        RB_STAT(++this->stats.comparisons);
+        if (comp(value, current->value))
+        {
+            dir = -1;
+            current = current->left;
+        }
+        else
+        {
+            dir = 1;
+            current = current->right;
+        }
+    }
+    Node<Type> *pNewNode = new_node(value);
+    insert_node(parent, dir, pNewNode);
     out_Value = RedBlackTreeIterator<Type, Comp>(pNewNode, 0);
+}
+
+/**
+ * Links a new node into the tree as the left (`dir` < 0) or right
+ * (`dir` > 0) child of `current`, which must not have a child on
+ * that side, and rebalances.  If `current` is null, the tree must be
+ * empty and the node becomes the root.
+ */
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::insert_node(Node<Type> *current, int dir,
+                                      Node<Type> *pNewNode)
+{
+    ++this->version;
+    if (!current)
+    {
+        rb_store_link(this->root, pNewNode);
+        this->root->red = false;
+        this->leftmost = this->rightmost = pNewNode;
+        augment_path(pNewNode);
+        return;
+    }
     // current is an internal node of the tree
-    if (it.getDir() < 0)
+    if (dir < 0)
     {
-        current->left = pNewNode;
+        rb_store_link(current->left, pNewNode);
+        if (current == this->leftmost) this->leftmost = pNewNode;
     }
     else
     {
-        current->right = pNewNode;
+        rb_store_link(current->right, pNewNode);
+        if (current == this->rightmost) this->rightmost = pNewNode;
     }
     pNewNode->parent = current;
+    // bring the new node's ancestors up to date before rebalancing;
+    // the rotations then preserve the augmentation
+    augment_path(pNewNode);
     // now rearrange the tree on the inserted node
     current = pNewNode;
     Node<Type> *parent;
@@ -336,20 +698,23 @@ RedBlackTree<Type, Comp>::insert(Type value,
         // then make it black and quit
         if (!parent)
         {
+            RB_STAT(++this->stats.insert_cases[1]);
             current->red = false;
-            return true;
+            return;
         }
         // case 2: parent is black
         // do nothing and quit
         if (!parent->red)
         {
-            return true;
+            RB_STAT(++this->stats.insert_cases[2]);
+            return;
         }
         // case 3: parent and uncle are red
         // make both black, make grandparent red, set current to
         // grandparent and repeat
         if (parent->red && uncle && uncle->red)
         {
+            RB_STAT(++this->stats.insert_cases[3]);
             parent->red = uncle->red = false;
             grandparent->red = true;
             current = grandparent;
@@ -368,6 +733,7 @@ RedBlackTree<Type, Comp>::insert(Type value,
         // need the old parent anymore)
         if (!current_left)
         {
+            RB_STAT(++this->stats.insert_cases[4]);
             //cout << "case 4 left: left rotate" << endl;
             left_rotate(parent);
             parent = current;
@@ -377,6 +743,7 @@ RedBlackTree<Type, Comp>::insert(Type value,
         // right rotate grandparent, make grandparent red, parent black
         //cout << "case 5 right: left rotate" << endl;
         //cout << "tree: " << this->to_string() << endl;
+        RB_STAT(++this->stats.insert_cases[5]);
         grandparent->red = true;
         parent->red = false;
         right_rotate(grandparent);
@@ -390,6 +757,7 @@ RedBlackTree<Type, Comp>::insert(Type value,
         // need the old parent anymore)
         if (current_left)
         {
+            RB_STAT(++this->stats.insert_cases[4]);
             //cout << "case 4 right: right rotate" << endl;
             right_rotate(parent);
             parent = current;
@@ -398,12 +766,60 @@ RedBlackTree<Type, Comp>::insert(Type value,
         // case 5: current is right child
         // left rotate grandparent, make grandparent red, parent black
         //cout << "case 5 right: left rotate" << endl;
+        RB_STAT(++this->stats.insert_cases[5]);
         grandparent->red = true;
         parent->red = false;
         left_rotate(grandparent);
         //cout << "tree: " << this->to_string() << endl;
     }
-    return true;
+}
+
+/**
+ * Returns an iterator to the first value in the tree that is not
+ * less than `in_Value`, or end() if there is none.
+ */
+template <typename Type, typename Comp>
+RedBlackTreeIterator<Type, Comp>
+RedBlackTree<Type, Comp>::lower_bound(Type &in_Value) const
+{
+    Node<Type> *current = this->root;
+    Node<Type> *result = 0;
+    while (current)
+    {
+        RB_STAT(++this->stats.comparisons);
+        if (comp(current->value, in_Value))
+            current = current->right;
+        else
+        {
+            result = current;
+            current = current->left;
+        }
+    }
+    return RedBlackTreeIterator<Type, Comp>(result, 0);
+}
+
+/**
+ * Returns an iterator to the first value in the tree that is greater
+ * than `in_Value`, or end() if there is none.
+ */
+template <typename Type, typename Comp>
+RedBlackTreeIterator<Type, Comp>
+RedBlackTree<Type, Comp>::upper_bound(Type &in_Value) const
+{
+    Node<Type> *current = this->root;
+    Node<Type> *result = 0;
+    while (current)
+    {
+        RB_STAT(++this->stats.comparisons);
+        if (comp(in_Value, current->value))
+        {
+            result = current;
+            current = current->left;
+        }
+        else
+            current = current->right;
+    }
+    return RedBlackTreeIterator<Type, Comp>(result, 0);
 }
 
 template <typename Type, typename Comp>
@@ -419,24 +835,249 @@ template <typename Type, typename Comp>
 void
 RedBlackTree<Type, Comp>::clear()
 {
-    if (this->root) delete this->root;
-    this->root = 0;
+    Node<Type> *node = release();
+    if (node) free_node(node);
 };
 
+template <typename Type, typename Comp>
+Node<Type>*
+RedBlackTree<Type, Comp>::release()
+{
+    Node<Type> *node = this->root;
+    rb_store_link(this->root, (Node<Type>*)0);
+    this->leftmost = 0;
+    this->rightmost = 0;
+    ++this->version;
+    return node;
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::detach()
+{
+    Node<Type> *node = release();
+    if (node) this->detached.push_back(node);
+}
+
+/**
+ * Frees up to `limit` of the nodes left behind by detach, calling
+ * dispose(value) on each one's value first.  The disposal may run
+ * arbitrary code, including calls back into this tree.
+ *
+ * \param limit maximum number of nodes to free
+ * \param dispose functor applied to the value of each freed node
+ * \return the number of nodes freed
+ */
+template <typename Type, typename Comp>
+template <typename Dispose>
+size_t
+RedBlackTree<Type, Comp>::drain(size_t limit, Dispose dispose)
+{
+    size_t freed = 0;
+    while (freed < limit && !this->detached.empty())
+    {
+        // work on a local copy, which reentrant calls cannot see
+        Node<Type> *node = this->detached.back();
+        this->detached.pop_back();
+        freed += destroy(node, limit - freed, dispose);
+        if (node) this->detached.push_back(node);
+    }
+    return freed;
+}
+
+/**
+ * Frees up to `limit` nodes of the subtree under `node`, calling
+ * dispose(value) on each one's value first, and leaves `node`
+ * pointing at what remains of the subtree (0 once it is gone).
+ *
+ * The teardown needs neither recursion nor a stack: while the top
+ * node has a left child, a right rotation lifts the child to the
+ * top; a top node without a left child is freed and replaced by its
+ * right child.  Each node is rotated past at most once, so freeing n
+ * nodes takes O(n) time, and as the left spine of the top node is
+ * never longer than the tree was high, there are O(log n) rotations
+ * between two frees.  Nodes are freed in order, and the parent links
+ * are ignored.
+ */
+template <typename Type, typename Comp>
+template <typename Dispose>
+size_t
+RedBlackTree<Type, Comp>::destroy(Node<Type>* &node, size_t limit,
+                                  Dispose &dispose)
+{
+    size_t freed = 0;
+    while (node && freed < limit)
+    {
+        Node<Type> *left = node->left;
+        if (left)
+        {
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        }
+        else
+        {
+            Node<Type> *doomed = node;
+            node = node->right;
+            dispose(doomed->value);
+            rb_delete_node(doomed);
+            ++freed;
+        }
+    }
+    return freed;
+}
+
+/**
+ * Replaces the contents of the tree with the values in [first,
+ * last), which may be in any order and may contain duplicates (the
+ * first of a run of equal values is kept, as with repeated calls to
+ * insert).  The input is sorted in parallel chunks, merged, and then
+ * handed to build_sorted.
+ *
+ * \param first start of the input range
+ * \param last end of the input range
+ * \param threads number of worker threads to use
+ * \return the number of values stored in the tree
+ */
+template <typename Type, typename Comp>
+template <typename Iter>
+size_t
+RedBlackTree<Type, Comp>::build(Iter first, Iter last, unsigned threads)
+{
+    vector<Type> values(first, last);
+    size_t n = values.size();
+    if (threads < 1) threads = 1;
+    if (n < threads * 4096) threads = 1;
+    Comp cmp = this->comp;
+    // sort equal-sized chunks concurrently
+    vector<size_t> bounds;
+    for (unsigned i = 0; i <= threads; ++i)
+        bounds.push_back(n * i / threads);
+    vector<thread> workers;
+    for (unsigned i = 1; i < threads; ++i)
+        workers.push_back(thread([&values, &bounds, cmp, i]() {
+                    std::stable_sort(values.begin() + bounds[i],
+                                     values.begin() + bounds[i + 1], cmp);
+                }));
+    std::stable_sort(values.begin(), values.begin() + bounds[1], cmp);
+    for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+    // merge neighbouring chunks pairwise, each round in parallel
+    for (unsigned width = 1; width < threads; width *= 2)
+    {
+        workers.clear();
+        for (unsigned i = 0; i + width < threads; i += 2 * width)
+        {
+            size_t lo = bounds[i];
+            size_t mid = bounds[i + width];
+            size_t hi = bounds[std::min(i + 2 * width, threads)];
+            workers.push_back(thread([&values, cmp, lo, mid, hi]() {
+                        std::inplace_merge(values.begin() + lo,
+                                           values.begin() + mid,
+                                           values.begin() + hi, cmp);
+                    }));
+        }
+        for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+    }
+    // drop duplicates, keeping the earliest of each run
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (kept && !cmp(values[kept - 1], values[i])) continue;
+        if (kept != i) values[kept] = values[i];
+        ++kept;
+    }
+    values.resize(kept);
+    return build_sorted(values.begin(), values.end(), threads);
+}
+
+/**
+ * Replaces the contents of the tree with the values in [first,
+ * last), which must be strictly increasing under the tree's
+ * comparator.  Runs in O(n) without any comparisons: the result is
+ * perfectly balanced, with every level black except for the
+ * partially filled bottom level, which is red.  Disjoint subtrees
+ * are built concurrently when more than one thread is given.
+ *
+ * \param first start of the (random access) input range
+ * \param last end of the input range
+ * \param threads number of worker threads to use
+ * \return the number of values stored in the tree
+ */
+template <typename Type, typename Comp>
+template <typename Iter>
+size_t
+RedBlackTree<Type, Comp>::build_sorted(Iter first, Iter last, unsigned threads)
+{
+    clear();
+    size_t n = last - first;
+    // depth of the first level that is not completely filled
+    size_t red_depth = 0;
+    while (((size_t)2 << red_depth) <= n + 1) ++red_depth;
+    this->root = _build(first, 0, n, 0, red_depth, threads < 1 ? 1 : threads);
+    if (this->augmented) set_augmented(true);
+    this->leftmost = this->rightmost = this->root;
+    if (this->root)
+    {
+        while (this->leftmost->left) this->leftmost = this->leftmost->left;
+        while (this->rightmost->right) this->rightmost = this->rightmost->right;
+    }
+    return n;
+}
+
+template <typename Type, typename Comp>
+template <typename Iter>
+Node<Type>*
+RedBlackTree<Type, Comp>::_build(Iter first, size_t lo, size_t hi,
+                                 size_t depth, size_t red_depth,
+                                 unsigned threads)
+{
+    if (lo >= hi) return 0;
+    size_t mid = lo + (hi - lo) / 2;
+    Node<Type> *node = new_node(*(first + mid));
+    node->red = (depth >= red_depth);
+    if (threads > 1 && hi - lo > 4096)
+    {
+        // left half in a new thread, right half in this one
+        unsigned left_threads = threads / 2;
+        Node<Type> *left = 0;
+        thread worker([this, first, lo, mid, depth, red_depth,
+                       left_threads, &left]() {
+                left = _build(first, lo, mid, depth + 1, red_depth,
+                              left_threads);
+            });
+        node->right = _build(first, mid + 1, hi, depth + 1, red_depth,
+                             threads - left_threads);
+        worker.join();
+        node->left = left;
+    }
+    else
+    {
+        node->left = _build(first, lo, mid, depth + 1, red_depth, 1);
+        node->right = _build(first, mid + 1, hi, depth + 1, red_depth, 1);
+    }
+    if (node->left) node->left->parent = node;
+    if (node->right) node->right->parent = node;
+    return node;
+}
+
 template <typename Type, typename Comp>
 RedBlackTreeIterator<Type, Comp>
-RedBlackTree<Type, Comp>::begin()
+RedBlackTree<Type, Comp>::begin() const
 {
-    if (!this->root) return RedBlackTreeIterator<Type, Comp>();
-    Node<Type> *current = this->root;
-    while (current->left)
-        current = current->left;
-    return RedBlackTreeIterator<Type, Comp>(current, 0);
+    return RedBlackTreeIterator<Type, Comp>(this->leftmost, 0);
 }
 
+// iterator to the largest value in the tree, or end() if empty
 template <typename Type, typename Comp>
 RedBlackTreeIterator<Type, Comp>
-RedBlackTree<Type, Comp>::end()
+RedBlackTree<Type, Comp>::last() const
+{
+    return RedBlackTreeIterator<Type, Comp>(this->rightmost, 0);
+}
+
+template <typename Type, typename Comp>
+RedBlackTreeIterator<Type, Comp>
+RedBlackTree<Type, Comp>::end() const
 {
     return RedBlackTreeIterator<Type, Comp>();
 }
@@ -477,8 +1118,11 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
     if (removeNode != foundNode)
     {
         Type temp = removeNode->value;
-        removeNode->value = foundNode->value;
-        foundNode->value = temp;
+        rb_relaxed_copy(removeNode->value, foundNode->value);
+        rb_relaxed_copy(foundNode->value, temp);
+        if (this->augmented)
+            std::swap(rb_augment_data(removeNode),
+                      rb_augment_data(foundNode));
     }
     Node<Type> *parent = removeNode->parent;
     bool remove_left = (parent && removeNode == parent->left);
@@ -492,22 +1136,32 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
         removeNode->red = true;
         childNode->red = false;
     }
-    if (remove_left) parent->left = childNode;
-    else if (parent) parent->right = childNode;
-    else this->root = childNode;
+    if (remove_left) rb_store_link(parent->left, childNode);
+    else if (parent) rb_store_link(parent->right, childNode);
+    else rb_store_link(this->root, childNode);
     if (childNode) childNode->parent = parent;
-    removeNode->left = removeNode->right = 0;
+    rb_store_link(removeNode->left, (Node<Type>*)0);
+    rb_store_link(removeNode->right, (Node<Type>*)0);
+    ++this->version;
+    // the first (last) node never has a right (left) child by the
+    // time it is chosen for removal, so the next one in line is its
+    // parent, which rebalancing will not move out of order
+    if (removeNode == this->leftmost) this->leftmost = parent;
+    if (removeNode == this->rightmost) this->rightmost = parent;
+    // foundNode, whose value has changed, is on this path
+    augment_path(parent);
     // if removeNode is red, replace it with its child, which must be
     // a leaf child
     if (removeNode->red)
     {
-        delete removeNode;
+        RB_STAT(++this->stats.remove_cases[0]);
+        free_node(removeNode);
         return true;
     }
 
     // remaining cases: removeNode is black and childNode is black
     // start by replacing remove with child
-    delete removeNode;
+    free_node(removeNode);
     // loop to rebalance
     Node<Type> *current = childNode;
     while (1)
@@ -515,7 +1169,11 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
         if (current) parent = current->parent;
         // case 1: childNode is the new root
         // we are done
-        if (!parent) return true;
+        if (!parent)
+        {
+            RB_STAT(++this->stats.remove_cases[1]);
+            return true;
+        }
         bool current_left = (parent && current == parent->left);
         Node<Type> *sibling = (current_left ? parent->right : parent->left);
         // case 2: sibling is red
@@ -523,6 +1181,7 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
         // left (if current_left)
         if (sibling->red)
         {
+            RB_STAT(++this->stats.remove_cases[2]);
             parent->red = true;
             sibling->red = false;
             if (current_left)
@@ -543,6 +1202,7 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
             (!sibling->left || !sibling->left->red) &&
             (!sibling->right || !sibling->right->red))
         {
+            RB_STAT(++this->stats.remove_cases[3]);
             sibling->red = true;
             current = parent;
             continue;
@@ -554,6 +1214,7 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
             (!sibling->left || !sibling->left->red) &&
             (!sibling->right || !sibling->right->red))
         {
+            RB_STAT(++this->stats.remove_cases[4]);
             parent->red = false;
             sibling->red = true;
             return true;
@@ -568,6 +1229,7 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
                 (sibling->left && sibling->left->red) &&
                 (!sibling->right || !sibling->right->red))
             {
+                RB_STAT(++this->stats.remove_cases[5]);
                 sibling->red = true;
                 sibling->left->red = false;
                 right_rotate(sibling);
@@ -577,6 +1239,7 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
                      (sibling->right && sibling->right->red) &&
                      (!sibling->left || !sibling->left->red))
             {
+                RB_STAT(++this->stats.remove_cases[5]);
                 sibling->red = true;
                 sibling->right->red = false;
                 left_rotate(sibling);
@@ -592,6 +1255,7 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
             if (current_left &&
                 (sibling->right && sibling->right->red))
             {
+                RB_STAT(++this->stats.remove_cases[6]);
                 left_rotate(parent);
                 sibling->red = parent->red;
                 parent->red = false;
@@ -601,6 +1265,7 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
             else if (!current_left &&
                      (sibling->left && sibling->left->red))
             {
+                RB_STAT(++this->stats.remove_cases[6]);
                 right_rotate(parent);
                 sibling->red = parent->red;
                 parent->red = false;
@@ -613,6 +1278,66 @@ RedBlackTree<Type, Comp>::remove(RedBlackTreeIterator<Type, Comp> &it,
     }
 }
 
+template <typename Type, typename Comp>
+bool
+RedBlackTree<Type, Comp>::stats_enabled()
+{
+#ifdef REDBLACK_STATS
+    return true;
+#else
+    return false;
+#endif // REDBLACK_STATS
+}
+
+/**
+ * Fills in `out` with the operation counters accumulated since the
+ * tree was created (or since the last call to reset_stats), and
+ * with the current depth profile of the tree.  Walking the tree
+ * costs O(n), but happens only here.
+ */
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::get_stats(RedBlackTreeStats &out) const
+{
+#ifdef REDBLACK_STATS
+    out = this->stats;
+#else
+    out = RedBlackTreeStats();
+#endif // REDBLACK_STATS
+    out.nodes = 0;
+    out.max_depth = 0;
+    out.avg_depth = 0.0;
+    out.depth_histogram.clear();
+    // pre-order walk with an explicit stack of (node, depth)
+    vector< pair<Node<Type>*, size_t> > stack;
+    if (this->root) stack.push_back(make_pair(this->root, (size_t)0));
+    double total_depth = 0.0;
+    while (!stack.empty())
+    {
+        Node<Type> *node = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        if (out.depth_histogram.size() <= depth)
+            out.depth_histogram.resize(depth + 1, 0);
+        ++out.depth_histogram[depth];
+        ++out.nodes;
+        total_depth += depth;
+        if (depth > out.max_depth) out.max_depth = depth;
+        if (node->left) stack.push_back(make_pair(node->left, depth + 1));
+        if (node->right) stack.push_back(make_pair(node->right, depth + 1));
+    }
+    if (out.nodes) out.avg_depth = total_depth / out.nodes;
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::reset_stats()
+{
+#ifdef REDBLACK_STATS
+    this->stats = RedBlackTreeStats();
+#endif // REDBLACK_STATS
+}
+
 #ifdef DEBUG
 template <typename Type, typename Comp>
 string
@@ -643,52 +1368,160 @@ template <typename Type, typename Comp>
 void
 RedBlackTree<Type, Comp>::left_rotate(Node<Type> *node)
 {
+    RB_STAT(++this->stats.left_rotations);
     Node<Type> *top = node->parent;
     Node<Type> *right_child = node->right;
     // right child of node becomes new top
     if (top)
     {
-        if (node == top->left) top->left = right_child;
-        else top->right = right_child;
+        if (node == top->left) rb_store_link(top->left, right_child);
+        else rb_store_link(top->right, right_child);
         right_child->parent = top;
     }
     else
     {
-        root = right_child;
+        rb_store_link(this->root, right_child);
         right_child->parent = 0;
     }
     // right child's left child becomes node's right child
-    node->right = right_child->left;
+    rb_store_link(node->right, right_child->left);
     if (node->right) node->right->parent = node;
     // node becomes right child's left child
-    right_child->left = node;
+    rb_store_link(right_child->left, node);
     node->parent = right_child;
+    if (this->augmented)
+    {
+        RedBlackAugment<Type>::update(node);
+        RedBlackAugment<Type>::update(right_child);
+    }
 }
 
 template <typename Type, typename Comp>
 void
 RedBlackTree<Type, Comp>::right_rotate(Node<Type> *node)
 {
+    RB_STAT(++this->stats.right_rotations);
     Node<Type> *top = node->parent;
     Node<Type> *left_child = node->left;
     // left child of node becomes new top
     if (top)
     {
-        if (node == top->right) top->right = left_child;
-        else top->left = left_child;
+        if (node == top->right) rb_store_link(top->right, left_child);
+        else rb_store_link(top->left, left_child);
         left_child->parent = top;
     }
     else
     {
-        this->root = left_child;
+        rb_store_link(this->root, left_child);
         left_child->parent = 0;
     }
     // left child's right child becomes node's left child
-    node->left = left_child->right;
+    rb_store_link(node->left, left_child->right);
     if (node->left) node->left->parent = node;
     // node becomes left child's right child
-    left_child->right = node;
+    rb_store_link(left_child->right, node);
     node->parent = left_child;
+    if (this->augmented)
+    {
+        RedBlackAugment<Type>::update(node);
+        RedBlackAugment<Type>::update(left_child);
+    }
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::set_augmented(bool augmented)
+{
+    if (augmented != this->augmented)
+    {
+        this->augmented = augmented;
+        reallocate_nodes();
+    }
+    if (!augmented) return;
+    // post-order walk with an explicit stack of (node, children done)
+    vector< pair<Node<Type>*, bool> > stack;
+    if (this->root) stack.push_back(make_pair(this->root, false));
+    while (!stack.empty())
+    {
+        Node<Type> *node = stack.back().first;
+        if (stack.back().second)
+        {
+            stack.pop_back();
+            RedBlackAugment<Type>::update(node);
+            continue;
+        }
+        stack.back().second = true;
+        if (node->left) stack.push_back(make_pair(node->left, false));
+        if (node->right) stack.push_back(make_pair(node->right, false));
+    }
+}
+
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::augment_path(Node<Type> *node)
+{
+    if (!this->augmented) return;
+    for (; node; node = node->parent)
+        RedBlackAugment<Type>::update(node);
+}
+
+/**
+ * Replaces every node of the tree with a copy allocated by new_node,
+ * after augmentation has been switched on or off.  The copies are
+ * all allocated before the tree is touched, so that it is left as it
+ * was if allocation fails.
+ */
+template <typename Type, typename Comp>
+void
+RedBlackTree<Type, Comp>::reallocate_nodes()
+{
+    // nodes in pre-order, so that each parent is replaced before its
+    // children
+    vector<Node<Type>*> nodes;
+    vector<Node<Type>*> stack;
+    if (this->root) stack.push_back(this->root);
+    while (!stack.empty())
+    {
+        Node<Type> *node = stack.back();
+        stack.pop_back();
+        nodes.push_back(node);
+        if (node->right) stack.push_back(node->right);
+        if (node->left) stack.push_back(node->left);
+    }
+    vector<Node<Type>*> copies;
+    copies.reserve(nodes.size());
+    try
+    {
+        for (size_t i = 0; i < nodes.size(); ++i)
+            copies.push_back(new_node(nodes[i]->value));
+    }
+    catch (...)
+    {
+        for (size_t i = 0; i < copies.size(); ++i)
+            rb_delete_node(copies[i]);
+        this->augmented = !this->augmented;
+        throw;
+    }
+    ++this->version;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        Node<Type> *node = nodes[i];
+        Node<Type> *copy = copies[i];
+        copy->red = node->red;
+        copy->left = node->left;
+        copy->right = node->right;
+        // the parent, if any, has already been replaced by its copy,
+        // which still links to this node
+        copy->parent = node->parent;
+        if (!copy->parent) this->root = copy;
+        else if (copy->parent->left == node) copy->parent->left = copy;
+        else copy->parent->right = copy;
+        if (copy->left) copy->left->parent = copy;
+        if (copy->right) copy->right->parent = copy;
+        if (node == this->leftmost) this->leftmost = copy;
+        if (node == this->rightmost) this->rightmost = copy;
+        rb_delete_node(node);
+    }
 }
 
 #endif /* _REDBLACK_H_ */
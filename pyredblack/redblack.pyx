@@ -8,13 +8,27 @@ Cython source to make red-black tree-based containers.
 '''
 
 from libcpp cimport bool
+from libcpp.vector cimport vector
 from cpython.ref cimport PyObject
+from cpython.buffer cimport PyBUF_WRITABLE
 from cython.operator import dereference, preincrement
 
 cdef extern from "prbconfig.h":
     cdef int PYTHON_VERSION2
 
 cdef extern from "pyredblack.h":
+    cdef cppclass RedBlackTreeStats:
+        RedBlackTreeStats() except +
+        unsigned long comparisons
+        unsigned long left_rotations
+        unsigned long right_rotations
+        unsigned long insert_cases[6]
+        unsigned long remove_cases[7]
+        size_t nodes
+        size_t max_depth
+        double avg_depth
+        vector[size_t] depth_histogram
+
     cdef cppclass ObjectRBTreeIterator:
         ObjectRBTreeIterator() except +
         ObjectRBTreeIterator& equals "operator="(const ObjectRBTreeIterator&)
@@ -32,10 +46,53 @@ cdef extern from "pyredblack.h":
         #bool remove(pyobjpairw value)
         bool del_obj(object obj)
         bool add_obj(object obj)
+        bool add_obj_bounded(object obj, size_t size, size_t maxlen,
+                             bool evict_max)
         bool pop_first_save_obj(object obj)
+        bool load_sorted_objs(object seq, bool check) except *
+        void add_obj_multi(object obj)
+        ObjectRBTreeIterator lower_bound_obj(object obj)
+        ObjectRBTreeIterator upper_bound_obj(object obj)
+        size_t count_obj(object obj)
+        bool del_obj_first(object obj)
+        size_t del_obj_all(object obj)
         ObjectRBTreeIterator begin()
         ObjectRBTreeIterator end()
         void clear_objs()
+        void clear_objs_incremental()
+        size_t drain_objs(size_t limit)
+        bool stats_enabled()
+        void get_stats(RedBlackTreeStats &out)
+
+    cdef cppclass pyobjcount:
+        PyObject* obj
+        size_t count
+
+    cdef cppclass CountRBTreeIterator:
+        CountRBTreeIterator() except +
+        CountRBTreeIterator& equals "operator="(const CountRBTreeIterator&)
+        CountRBTreeIterator& operator++()
+        pyobjcount& operator*() const
+        bool operator==(const CountRBTreeIterator&)
+        bool operator!=(const CountRBTreeIterator&)
+        bool valid()
+        int getDir()
+
+    cdef cppclass CountRBTree:
+        CountRBTree() except +
+        void add_obj(object obj)
+        CountRBTreeIterator find_obj(object obj)
+        size_t count_obj(object obj)
+        bool del_obj(object obj)
+        size_t del_obj_all(object obj)
+        bool pop_first_save_obj(object obj)
+        CountRBTreeIterator begin()
+        CountRBTreeIterator end()
+        void clear_objs()
+        void clear_objs_incremental()
+        size_t drain_objs(size_t limit)
+        bool stats_enabled()
+        void get_stats(RedBlackTreeStats &out)
 
     cdef cppclass pyobjpairw:
         pyobjpairw() except +
@@ -62,24 +119,227 @@ cdef extern from "pyredblack.h":
         bool del_key_save_value(object key, object value)
         PyObject* get_value_for_key(object key, bool &found)
         bool set_key(object key, object value)
+        bool set_key_bounded(object key, object value, size_t size,
+                             size_t maxlen, bool evict_max)
+        PyObject* setdefault_key(object key, object dflt, bool &inserted)
+        PyObject* get_or_insert_key(object key, object factory,
+                                    bool &inserted) except NULL
+        PyObject* update_key_with(object key, object fn, object dflt,
+                                  bool &inserted) except NULL
+        PyObject* increment_key(object key, object delta, object dflt,
+                                bool &inserted) except NULL
+        void enable_digests()
+        bool digests_enabled()
+        unsigned long long range_digest(PyObject *lo, PyObject *hi)
+        int diff_keys(PairRBTree *other, PyObject *lo, PyObject *hi,
+                      object out) except -1
+        void export_range(PyObject *lo, PyObject *hi, bool values,
+                          PyObjectArray &out) except *
+        Py_ssize_t apply_sorted(object keys, object values, object deleted,
+                                size_t size) except? -1
         bool pop_first_save_item(object key, object value)
+        void add_item_multi(object key, object value)
+        PairRBTreeIterator lower_bound_key(object key)
+        PairRBTreeIterator upper_bound_key(object key)
+        size_t count_key(object key)
+        bool del_key_first_save_value(object key, object value)
+        size_t del_key_all(object key)
+        bool load_sorted_items(object keys, object values, bool check) except *
         PairRBTreeIterator begin()
         PairRBTreeIterator end()
         void clear_objs()
+        void clear_objs_incremental()
+        size_t drain_objs(size_t limit)
+        bool stats_enabled()
+        void get_stats(RedBlackTreeStats &out)
+
+    cdef cppclass ObjectRBMerge:
+        ObjectRBMerge(bool dedupe, bool reverse) except +
+        void add_tree(ObjectRBTree *tree, PyObject *lo, PyObject *hi)
+        bool next_obj(PyObject *&obj)
+        size_t drain_into(ObjectRBTree *tree, bool reverse)
+
+    cdef cppclass PairRBMerge:
+        PairRBMerge(bool dedupe, bool reverse) except +
+        void add_tree(PairRBTree *tree, PyObject *lo, PyObject *hi)
+        bool next_item(PyObject *&key, PyObject *&value)
+        size_t drain_into(PairRBTree *tree, bool reverse)
+
+    cdef cppclass PyObjectArray:
+        PyObjectArray() except +
+        const char* getFormat()
+        size_t size()
+        size_t itemsize()
+        void* data()
+        object item(size_t i)
+
+cdef dict _stats_dict(RedBlackTreeStats &stats, bool enabled):
+    '''Convert tree statistics into a dictionary.'''
+    cdef size_t depth
+    cdef int case
+    histogram = []
+    for depth in range(stats.depth_histogram.size()):
+        histogram.append(stats.depth_histogram[depth])
+    rv = {'nodes': stats.nodes,
+          'max_depth': stats.max_depth,
+          'avg_depth': stats.avg_depth,
+          'depth_histogram': histogram,
+          'counters_enabled': enabled}
+    if enabled:
+        rv['comparisons'] = stats.comparisons
+        rv['rotations'] = {'left': stats.left_rotations,
+                           'right': stats.right_rotations}
+        rv['insert_fixup'] = {}
+        for case in range(1, 6):
+            rv['insert_fixup'][case] = stats.insert_cases[case]
+        rv['remove_fixup'] = {}
+        for case in range(0, 7):
+            rv['remove_fixup'][case] = stats.remove_cases[case]
+    return rv
+
+# markers for deleted and missing keys in an rbdict's write buffer
+cdef object _DELETED = object()
+cdef object _ABSENT = object()
+
+cdef Py_ssize_t _check_maxlen(maxlen, evict) except -2:
+    '''Validate bounded-capacity arguments, returning -1 for no bound.'''
+    if evict not in ('min', 'max'):
+        raise ValueError("evict must be 'min' or 'max'")
+    if maxlen is None:
+        return -1
+    if maxlen < 0:
+        raise ValueError('maxlen must be non-negative')
+    return maxlen
+
+cdef size_t _drain_limit(n) except? 0:
+    '''Validate the argument to `drain()`, returning -1 for no limit.'''
+    if n is None:
+        return <size_t>-1
+    if n < 0:
+        raise ValueError('n must be non-negative')
+    return n
+
+cdef class rbarray(object):
+    '''
+    Read-only one-dimensional array of keys or values exported from an
+    rbdict, held in a single contiguous buffer. Supports the buffer
+    protocol, so `memoryview(a)` and `numpy.asarray(a)` share its
+    memory without copying. Integers that all fit in 64 bits are
+    stored with format 'q', floats with format 'd', and anything else
+    as object references (format 'O').
+    '''
+
+    cdef PyObjectArray *_array
+    cdef Py_ssize_t _shape[1]
+    cdef Py_ssize_t _strides[1]
+
+    def __cinit__(self):
+        '''C Constructor.'''
+        self._array = new PyObjectArray()
+
+    def __dealloc__(self):
+        '''Destructor.'''
+        if self._array is not NULL:
+            del self._array
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        '''Expose the array through the buffer protocol.'''
+        if flags & PyBUF_WRITABLE:
+            raise BufferError('rbarray is read-only')
+        self._shape[0] = self._array.size()
+        self._strides[0] = self._array.itemsize()
+        buffer.buf = self._array.data()
+        buffer.obj = self
+        buffer.len = self._shape[0] * self._strides[0]
+        buffer.readonly = 1
+        buffer.itemsize = self._strides[0]
+        buffer.format = <char*>self._array.getFormat()
+        buffer.ndim = 1
+        buffer.shape = self._shape
+        buffer.strides = self._strides
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        '''The array is immutable, so there is nothing to release.'''
+        pass
+
+    property format:
+        '''The struct format of the items: 'q', 'd' or 'O'.'''
+        def __get__(self):
+            return self._array.getFormat().decode('ascii')
+
+    def __len__(self):
+        '''Return the number of items in the array.'''
+        return self._array.size()
+
+    def __getitem__(self, Py_ssize_t index):
+        '''Return the item at `index`.'''
+        cdef Py_ssize_t size = self._array.size()
+        if index < 0:
+            index += size
+        if not 0 <= index < size:
+            raise IndexError('rbarray index out of range')
+        return self._array.item(index)
+
+    def __iter__(self):
+        '''Return an iterator over the items.'''
+        cdef size_t i
+        for i in range(self._array.size()):
+            yield self._array.item(i)
+
+    def tolist(self):
+        '''Return the items as a list.'''
+        cdef size_t i
+        rv = []
+        for i in range(self._array.size()):
+            rv.append(self._array.item(i))
+        return rv
+
+    def __repr__(self):
+        '''Return a string representation of the array.'''
+        return 'rbarray({!r}, format={!r})'.format(self.tolist(), self.format)
+
+cdef list _array_to_list(arr):
+    '''
+    Return the items of `arr` as a list. Buffers of native numbers
+    (such as rbarrays or NumPy arrays) are converted to Python ints
+    and floats without iterating over them in Python.
+    '''
+    if isinstance(arr, rbarray):
+        return (<rbarray>arr).tolist()
+    try:
+        return memoryview(arr).tolist()
+    except (TypeError, ValueError, NotImplementedError):
+        return list(arr)
 
 cdef class rbset(object):
-    '''Red-black-tree-based set.'''
+    '''
+    Red-black-tree-based set.
+
+    If `maxlen` is given, the set holds at most that many elements:
+    once it is full, adding an element evicts the smallest one (or the
+    largest, with `evict='max'`), which makes it a top-k (bottom-k)
+    filter over a stream. An element that would itself be evicted is
+    not added.
+    '''
 
     cdef ObjectRBTree *_tree
     cdef int _num_nodes
+    cdef Py_ssize_t _maxlen
+    cdef bool _evict_max
 
     def __cinit__(self):
         '''C Constructor.'''
         self._tree = new ObjectRBTree()
         self._num_nodes = 0
+        self._maxlen = -1
+        self._evict_max = False
 
-    def __init__(self, iterable = None):
+    def __init__(self, iterable = None, maxlen = None, evict = 'min'):
         '''Python Constructor.'''
+        self._maxlen = _check_maxlen(maxlen, evict)
+        self._evict_max = (evict == 'max')
         self.update(iterable)
 
     def __dealloc__(self):
@@ -92,6 +352,50 @@ cdef class rbset(object):
         '''Return the number of items in the set.'''
         return self._num_nodes
 
+    property maxlen:
+        '''The maximum number of elements, or None if unbounded.'''
+        def __get__(self):
+            return None if self._maxlen < 0 else self._maxlen
+
+    property evict:
+        '''Which end of the set is evicted when it is full.'''
+        def __get__(self):
+            return 'max' if self._evict_max else 'min'
+
+    def __reduce__(self):
+        '''
+        Support for pickling. The state holds the number of elements
+        followed by the elements themselves in sorted order, which
+        lets unpickling rebuild the tree in linear time.
+        '''
+        return (type(self), (None, self.maxlen, self.evict),
+                (self._num_nodes, list(self)))
+
+    def __setstate__(self, state):
+        '''Restore the set from the state produced by `__reduce__()`.'''
+        count, elems = state
+        if len(elems) != count:
+            raise ValueError('corrupt rbset state')
+        self._load_sorted(elems, True)
+
+    cdef _load_sorted(self, elems, bool check):
+        '''
+        Replace the contents of the set with `elems`, which should be
+        in sorted order without duplicates. If `check` is true and they
+        are not, fall back to inserting them one at a time.
+        '''
+        elems = list(elems)
+        for elem in elems:
+            _hash = hash(elem)
+        if 0 <= self._maxlen < len(elems):
+            self.clear()
+            self.update(elems)
+        elif self._tree.load_sorted_objs(elems, check):
+            self._num_nodes = len(elems)
+        else:
+            self.clear()
+            self.update(elems)
+
     def __contains__(self, elem):
         '''Return `True` if the set has a member `elem`, else `False`.'''
         _hash = hash(elem)
@@ -100,6 +404,18 @@ cdef class rbset(object):
             return True
         return False
 
+    def stats(self):
+        '''
+        Return a dictionary describing the shape of the tree (`nodes`,
+        `max_depth`, `avg_depth`, `depth_histogram`). If the module was
+        built with `PYREDBLACK_STATS` set, it also holds the number of
+        `comparisons`, `rotations` by direction, and the `insert_fixup`
+        and `remove_fixup` iterations by case since the set was created.
+        '''
+        cdef RedBlackTreeStats stats
+        self._tree.get_stats(stats)
+        return _stats_dict(stats, self._tree.stats_enabled())
+
     def __iter__(self):
         '''Return an iterator over the items in the set.'''
         cdef ObjectRBTreeIterator it = self._tree.begin()
@@ -110,7 +426,11 @@ cdef class rbset(object):
     def add(self, elem):
         '''Add element `elem` to the set.'''
         _hash = hash(elem)
-        if self._tree.add_obj(elem):
+        if self._maxlen >= 0:
+            if self._tree.add_obj_bounded(elem, self._num_nodes, self._maxlen,
+                                          self._evict_max):
+                self._num_nodes += 1
+        elif self._tree.add_obj(elem):
             self._num_nodes += 1
 
     def remove(self, elem):
@@ -142,10 +462,27 @@ cdef class rbset(object):
         else:
             raise KeyError('pop from an empty set')
 
-    def clear(self):
-        '''Remove all items from the set.'''
-        self._tree.clear_objs()
+    def clear(self, incremental = False):
+        '''
+        Remove all items from the set. With `incremental=True`, this
+        takes constant time: the items are released a few at a time by
+        later updates, or by `drain()`, so that emptying a large set
+        does not stall the program.
+        '''
+        # reset first, in case releasing the items adds new ones
         self._num_nodes = 0
+        if incremental:
+            self._tree.clear_objs_incremental()
+        else:
+            self._tree.clear_objs()
+
+    def drain(self, n = None):
+        '''
+        Free up to `n` (by default, all) of the items left behind by
+        `clear(incremental=True)`, and return the number of tree nodes
+        freed; 0 means that nothing is left.
+        '''
+        return self._tree.drain_objs(_drain_limit(n))
 
     def isdisjoint(self, other):
         '''
@@ -301,7 +638,9 @@ cdef class rbset(object):
 
     def copy(self):
         '''Return a new set with a shallow copy of the set.'''
-        return rbset(self)
+        cdef rbset rv = rbset(maxlen=self.maxlen, evict=self.evict)
+        rv._load_sorted(self, False)
+        return rv
 
     def update(self, other, *others):
         '''Update the set, adding elements from all others.'''
@@ -387,18 +726,38 @@ cdef class rbset(object):
 
 
 cdef class rbdict(object):
-    '''Red-black-tree-based associative array.'''
+    '''
+    Red-black-tree-based associative array.
+
+    If `maxlen` is given, the dictionary holds at most that many items:
+    once it is full, storing a new key evicts the item with the
+    smallest key (or the largest, with `evict='max'`). A new key that
+    would itself be evicted is not stored.
+    '''
 
     cdef PairRBTree *_tree
     cdef int _num_nodes
+    cdef Py_ssize_t _maxlen
+    cdef bool _evict_max
+    # pending writes (key -> value or _DELETED) when writes are
+    # buffered, else None
+    cdef dict _buffer
+    cdef Py_ssize_t _buffer_size
 
     def __cinit__(self):
         '''C Constructor.'''
         self._tree = new PairRBTree()
         self._num_nodes = 0
+        self._maxlen = -1
+        self._evict_max = False
+        self._buffer = None
+        self._buffer_size = 0
 
-    def __init__(self, mapping = None, **kwargs):
+    def __init__(self, mapping = None, maxlen = None, evict = 'min',
+                 **kwargs):
         '''Python Constructor.'''
+        self._maxlen = _check_maxlen(maxlen, evict)
+        self._evict_max = (evict == 'max')
         self.update(mapping, **kwargs)
 
     def __dealloc__(self):
@@ -409,8 +768,96 @@ cdef class rbdict(object):
 
     def __len__(self):
         '''Return the number of items in the dictionary.'''
+        self._flush()
         return self._num_nodes
 
+    def buffer_writes(self, size):
+        '''
+        Buffer up to `size` writes (stores and deletions) before
+        applying them to the tree, or stop buffering if `size` is 0.
+        Buffered writes are sorted and applied in a single pass when
+        the buffer fills, or when an operation other than a lookup,
+        store or deletion of a single key needs the tree; lookups see
+        buffered writes straight away. This makes bursts of writes
+        cheaper without changing what the dictionary holds.
+        '''
+        if size < 0:
+            raise ValueError('size must be non-negative')
+        if size and self._maxlen >= 0:
+            raise ValueError('cannot buffer writes to a bounded dictionary')
+        self._flush()
+        self._buffer_size = size
+        self._buffer = {} if size else None
+
+    property write_buffer:
+        '''The number of writes that may be buffered (0 if none).'''
+        def __get__(self):
+            return self._buffer_size
+
+    def flush(self):
+        '''Apply any buffered writes to the tree.'''
+        self._flush()
+
+    cdef _flush(self):
+        '''Apply the buffered writes in key order.'''
+        if not self._buffer:
+            return
+        keys = sorted(self._buffer)
+        values = [self._buffer[key] for key in keys]
+        self._buffer.clear()
+        self._num_nodes += self._tree.apply_sorted(keys, values, _DELETED,
+                                                   self._num_nodes)
+
+    property maxlen:
+        '''The maximum number of items, or None if unbounded.'''
+        def __get__(self):
+            return None if self._maxlen < 0 else self._maxlen
+
+    property evict:
+        '''Which end of the dictionary is evicted when it is full.'''
+        def __get__(self):
+            return 'max' if self._evict_max else 'min'
+
+    def __reduce__(self):
+        '''
+        Support for pickling. The state holds the number of items
+        followed by the keys in sorted order and their values, which
+        lets unpickling rebuild the tree in linear time.
+        '''
+        self._flush()
+        return (type(self), (None, self.maxlen, self.evict),
+                (self._num_nodes, list(self.iterkeys()),
+                 list(self.itervalues())))
+
+    def __setstate__(self, state):
+        '''Restore the dictionary from the state produced by `__reduce__()`.'''
+        count, keys, values = state
+        if len(keys) != count or len(values) != count:
+            raise ValueError('corrupt rbdict state')
+        self._load_sorted(keys, values, True)
+
+    cdef _load_sorted(self, keys, values, bool check):
+        '''
+        Replace the contents of the dictionary with `keys` (which should
+        be in sorted order without duplicates) and the corresponding
+        `values`. If `check` is true and the keys are not sorted,
+        fall back to inserting them one at a time.
+        '''
+        keys = list(keys)
+        values = list(values)
+        for key in keys:
+            _hash = hash(key)
+        if self._buffer:
+            self._buffer.clear()
+        if 0 <= self._maxlen < len(keys):
+            self.clear()
+            self.update(zip(keys, values))
+        elif self._tree.load_sorted_items(keys, values, check):
+            self._num_nodes = len(keys)
+        else:
+            self.clear()
+            self.update(zip(keys, values))
+
     def __missing__(self, key):
         '''
         Called by `__getitem__()` to implement `self[key]` for dict
@@ -426,6 +873,12 @@ cdef class rbdict(object):
         '''
         _hash = hash(key)
         cdef bool found = False
+        if self._buffer is not None:
+            value = self._buffer.get(key, _ABSENT)
+            if value is _DELETED:
+                return self.__missing__(key)
+            elif value is not _ABSENT:
+                return value
         value = <object>self._tree.get_value_for_key(key, found)
         if not found:
             return self.__missing__(key)
@@ -434,7 +887,15 @@ cdef class rbdict(object):
     def __setitem__(self, key, value):
         '''Associates `key` with `value`.'''
         _hash = hash(key)
-        if self._tree.set_key(key, value):
+        if self._buffer is not None:
+            self._buffer[key] = value
+            if len(self._buffer) >= self._buffer_size:
+                self._flush()
+        elif self._maxlen >= 0:
+            if self._tree.set_key_bounded(key, value, self._num_nodes,
+                                          self._maxlen, self._evict_max):
+                self._num_nodes += 1
+        elif self._tree.set_key(key, value):
             self._num_nodes += 1
 
     def __delitem__(self, key):
@@ -443,7 +904,14 @@ cdef class rbdict(object):
         not in the map.
         '''
         _hash = hash(key)
-        if self._tree.del_key(key):
+        if self._buffer is not None:
+            # the key must exist, in the buffer or the tree
+            if not self.__contains__(key):
+                raise KeyError(key)
+            self._buffer[key] = _DELETED
+            if len(self._buffer) >= self._buffer_size:
+                self._flush()
+        elif self._tree.del_key(key):
             self._num_nodes -= 1
         else:
             raise KeyError(key)
@@ -452,12 +920,30 @@ cdef class rbdict(object):
         '''Return `True` if the dictionary has a key `key`, else `False`.'''
         _hash = hash(key)
         cdef pyobjpairw probe
+        if self._buffer is not None:
+            value = self._buffer.get(key, _ABSENT)
+            if value is not _ABSENT:
+                return value is not _DELETED
         probe = pyobjpairw(key, None)
         cdef PairRBTreeIterator it = self._tree.find(probe)
         if it.valid() and it.getDir() == 0:
             return True
         return False
 
+    def stats(self):
+        '''
+        Return a dictionary describing the shape of the tree (`nodes`,
+        `max_depth`, `avg_depth`, `depth_histogram`). If the module was
+        built with `PYREDBLACK_STATS` set, it also holds the number of
+        `comparisons`, `rotations` by direction, and the `insert_fixup`
+        and `remove_fixup` iterations by case since the dictionary was
+        created.
+        '''
+        cdef RedBlackTreeStats stats
+        self._flush()
+        self._tree.get_stats(stats)
+        return _stats_dict(stats, self._tree.stats_enabled())
+
     def __iter__(self):
         '''Return an iterator over the keys of the dictionary.'''
         return self.iterkeys()
@@ -496,15 +982,39 @@ cdef class rbdict(object):
         '''
         _hash = hash(key)
         cdef bool found = False
+        if self._buffer is not None:
+            value = self._buffer.get(key, _ABSENT)
+            if value is _DELETED:
+                return default
+            elif value is not _ABSENT:
+                return value
         value = <object>self._tree.get_value_for_key(key, found)
         if not found:
             return default
         return value
 
-    def clear(self):
-        '''Remove all items from the dictionary.'''
-        self._tree.clear_objs()
+    def clear(self, incremental = False):
+        '''
+        Remove all items from the dictionary. With `incremental=True`,
+        this takes constant time: the items are released a few at a
+        time by later updates, or by `drain()`.
+        '''
+        if self._buffer:
+            self._buffer.clear()
+        # reset first, in case releasing the items adds new ones
         self._num_nodes = 0
+        if incremental:
+            self._tree.clear_objs_incremental()
+        else:
+            self._tree.clear_objs()
+
+    def drain(self, n = None):
+        '''
+        Free up to `n` (by default, all) of the items left behind by
+        `clear(incremental=True)`, and return the number of tree nodes
+        freed; 0 means that nothing is left.
+        '''
+        return self._tree.drain_objs(_drain_limit(n))
 
     def setdefault(self, key, default = None):
         '''
@@ -513,15 +1023,186 @@ cdef class rbdict(object):
         `default`. `default` defaults to None.
         '''
         _hash = hash(key)
-        # TODO: this could be one tree access instead of two
-        try:
-            return self.__getitem__(key)
-        except KeyError:
-            self.__setitem__(key, default)
-            return default
+        cdef bool inserted = False
+        self._flush()
+        if self._maxlen >= 0:
+            # the item might be evicted, or evict another one
+            try:
+                return self.__getitem__(key)
+            except KeyError:
+                self.__setitem__(key, default)
+                return default
+        value = <object>self._tree.setdefault_key(key, default, inserted)
+        if inserted:
+            self._num_nodes += 1
+        return value
+
+    def get_or_insert(self, key, factory):
+        '''
+        If `key` is in the dictionary, return its value. If not, insert
+        `key` with a value of `factory()` and return that value. The
+        factory is only called if `key` is missing.
+        '''
+        _hash = hash(key)
+        cdef bool inserted = False
+        self._flush()
+        if self._maxlen >= 0:
+            try:
+                return self.__getitem__(key)
+            except KeyError:
+                value = factory()
+                self.__setitem__(key, value)
+                return value
+        value = <object>self._tree.get_or_insert_key(key, factory, inserted)
+        if inserted:
+            self._num_nodes += 1
+        return value
+
+    def update_with(self, key, fn, default = None):
+        '''
+        Set the value for `key` to `fn(value)`, where `value` is its
+        current value, or `default` if `key` is not in the
+        dictionary. Returns the new value.
+        '''
+        _hash = hash(key)
+        cdef bool inserted = False
+        self._flush()
+        if self._maxlen >= 0:
+            value = fn(self.get(key, default))
+            self.__setitem__(key, value)
+            return value
+        value = <object>self._tree.update_key_with(key, fn, default, inserted)
+        if inserted:
+            self._num_nodes += 1
+        return value
+
+    def increment(self, key, delta = 1, default = 0):
+        '''
+        Add `delta` to the value for `key`, treating a missing key as
+        having the value `default`, and return the new value.
+        '''
+        _hash = hash(key)
+        cdef bool inserted = False
+        self._flush()
+        if self._maxlen >= 0:
+            value = self.get(key, default) + delta
+            self.__setitem__(key, value)
+            return value
+        value = <object>self._tree.increment_key(key, delta, default, inserted)
+        if inserted:
+            self._num_nodes += 1
+        return value
+
+    def enable_digests(self):
+        '''
+        Start keeping subtree digests: every node of the tree then
+        records a hash of the `(key, value)` entries below it, which
+        `digest()` and `diff()` use to compare dictionaries without
+        visiting every item. Enabling takes time proportional to the
+        size of the dictionary; afterwards each update costs
+        O(log n) more. Values that cannot be hashed are hashed by
+        identity, so changes made to them in place are not seen.
+        Digests take 16 more bytes per item; enabling them moves every
+        item into a larger node, so, like other updates, it must not
+        happen while the dictionary is being iterated over.
+        `digest()` and `diff()` enable digests when first called.
+        '''
+        self._flush()
+        self._tree.enable_digests()
+
+    property digests_enabled:
+        '''True if the dictionary keeps subtree digests.'''
+        def __get__(self):
+            return self._tree.digests_enabled()
+
+    def digest(self, lo = None, hi = None):
+        '''
+        Return a 64-bit digest of the items with keys `k` in the range
+        `lo <= k < hi` (all items by default). Dictionaries with
+        equal items have equal digests, as long as their values are
+        hashable (others are hashed by identity). Takes O(log n) time once
+        digests are enabled.
+        '''
+        cdef PyObject *lo_p = NULL
+        cdef PyObject *hi_p = NULL
+        if lo is not None:
+            _hash = hash(lo)
+            lo_p = <PyObject*>lo
+        if hi is not None:
+            _hash = hash(hi)
+            hi_p = <PyObject*>hi
+        self.enable_digests()
+        return self._tree.range_digest(lo_p, hi_p)
+
+    cdef rbarray _export(self, lo, hi, bool values):
+        '''Copy the keys or values of the items in `lo <= key < hi`.'''
+        cdef PyObject *lo_p = NULL
+        cdef PyObject *hi_p = NULL
+        self._flush()
+        if lo is not None:
+            _hash = hash(lo)
+            lo_p = <PyObject*>lo
+        if hi is not None:
+            _hash = hash(hi)
+            hi_p = <PyObject*>hi
+        cdef rbarray rv = rbarray()
+        self._tree.export_range(lo_p, hi_p, values, dereference(rv._array))
+        return rv
+
+    def keys_array(self, lo = None, hi = None):
+        '''
+        Return an rbarray of the keys `k` with `lo <= k < hi` (all
+        keys by default), in sorted order. The keys are copied into
+        one contiguous buffer in a single pass over the tree; numeric
+        keys are stored natively, so the result can be handed to
+        `memoryview` or NumPy without further conversion.
+        '''
+        return self._export(lo, hi, False)
+
+    def values_array(self, lo = None, hi = None):
+        '''
+        Return an rbarray of the values of the items with keys `k`
+        such that `lo <= k < hi` (all items by default), in key order.
+        '''
+        return self._export(lo, hi, True)
+
+    @classmethod
+    def from_arrays(cls, keys, values):
+        '''
+        Create a dictionary from a sequence of keys in sorted order
+        without duplicates and a sequence of the same length holding
+        their values, for instance the results of `keys_array()` and
+        `values_array()`. Sorted keys are loaded in linear time;
+        otherwise they are inserted one at a time.
+        '''
+        keys = _array_to_list(keys)
+        values = _array_to_list(values)
+        if len(keys) != len(values):
+            raise ValueError('keys and values must have the same length')
+        rv = cls()
+        (<rbdict>rv)._load_sorted(keys, values, True)
+        return rv
+
+    def diff(self, rbdict other):
+        '''
+        Return a sorted list of the keys that are in only one of this
+        dictionary and `other`, or that map to unequal values. Ranges
+        of keys whose digests agree are skipped, so the time taken
+        grows with the number of differences (times log^2 n) rather
+        than with the size of the dictionaries. Values are compared
+        with `==` wherever the digests disagree; as values that cannot
+        be hashed are hashed by identity, ranges holding equal copies
+        of them are always visited.
+        '''
+        self.enable_digests()
+        other.enable_digests()
+        rv = []
+        self._tree.diff_keys(other._tree, NULL, NULL, rv)
+        return rv
 
     def iterkeys(self):
         '''Return an iterator over the dictionary’s keys.'''
+        self._flush()
         cdef PairRBTreeIterator it = self._tree.begin()
         while it != self._tree.end():
             yield <object>dereference(it).getFirst()
@@ -529,6 +1210,7 @@ cdef class rbdict(object):
 
     def itervalues(self):
         '''Return an iterator over the dictionary’s values.'''
+        self._flush()
         cdef PairRBTreeIterator it = self._tree.begin()
         while it != self._tree.end():
             yield <object>dereference(it).getSecond()
@@ -536,6 +1218,7 @@ cdef class rbdict(object):
 
     def iteritems(self):
         '''Return an iterator over the dictionary’s `(key, value)` pairs.'''
+        self._flush()
         cdef PairRBTreeIterator it = self._tree.begin()
         while it != self._tree.end():
             yield (<object>dereference(it).getFirst(),
@@ -549,6 +1232,7 @@ cdef class rbdict(object):
         '''
         _hash = hash(key)
         cdef object value = default
+        self._flush()
         if self._tree.del_key_save_value(key, value):
             self._num_nodes -= 1
         return value
@@ -560,6 +1244,7 @@ cdef class rbdict(object):
         '''
         cdef object key = None
         cdef object value = None
+        self._flush()
         if self._tree.pop_first_save_item(key, value):
             self._num_nodes -= 1
             return (key, value)
@@ -567,7 +1252,12 @@ cdef class rbdict(object):
 
     def copy(self):
         '''Return a shallow copy of the dictionary.'''
-        return rbdict(self)
+        cdef rbdict rv = rbdict(maxlen=self.maxlen, evict=self.evict)
+        self._flush()
+        if self._tree.digests_enabled():
+            rv._tree.enable_digests()
+        rv._load_sorted(self.iterkeys(), self.itervalues(), False)
+        return rv
 
     def update(self, mapping = None, **kwargs):
         '''
@@ -606,3 +1296,516 @@ cdef class rbdict(object):
                     self[key] = val
         for key, val in kwargs.items():
             self[key] = val
+
+
+cdef class rbmultiset(object):
+    '''
+    Red-black-tree-based multiset: a sorted collection that may contain
+    several equal elements. Equal elements are kept in the order in
+    which they were added.
+
+    With `runlength=True`, a run of equal elements is stored as a
+    single node holding the first of them and a count. This saves
+    memory when elements are heavily duplicated, but iteration then
+    yields the first element of each run once per occurrence.
+    '''
+
+    cdef ObjectRBTree *_tree
+    cdef CountRBTree *_runs
+    cdef int _num_nodes
+
+    def __cinit__(self, iterable = None, runlength = False):
+        '''C Constructor.'''
+        if runlength:
+            self._runs = new CountRBTree()
+        else:
+            self._tree = new ObjectRBTree()
+        self._num_nodes = 0
+
+    def __init__(self, iterable = None, runlength = False):
+        '''Python Constructor.'''
+        self.update(iterable)
+
+    def __dealloc__(self):
+        '''Destructor.'''
+        if self._tree is not NULL:
+            self._tree.clear_objs()
+            del self._tree
+        if self._runs is not NULL:
+            self._runs.clear_objs()
+            del self._runs
+
+    property runlength:
+        '''True if equal elements are stored as a single counted node.'''
+        def __get__(self):
+            return self._runs is not NULL
+
+    def __len__(self):
+        '''Return the number of elements in the multiset.'''
+        return self._num_nodes
+
+    def __reduce__(self):
+        '''Support for pickling.'''
+        return (type(self), (list(self), self.runlength))
+
+    def __contains__(self, elem):
+        '''Return `True` if the multiset contains `elem`, else `False`.'''
+        return self.count(elem) > 0
+
+    def __iter__(self):
+        '''Return an iterator over the elements in sorted order.'''
+        cdef ObjectRBTreeIterator it
+        cdef CountRBTreeIterator rit
+        cdef size_t i
+        if self._runs is not NULL:
+            rit = self._runs.begin()
+            while rit != self._runs.end():
+                for i in range(dereference(rit).count):
+                    yield <object>dereference(rit).obj
+                preincrement(rit)
+        else:
+            it = self._tree.begin()
+            while it != self._tree.end():
+                yield <object>dereference(it)
+                preincrement(it)
+
+    def stats(self):
+        '''Return a dictionary describing the tree; see `rbset.stats()`.'''
+        cdef RedBlackTreeStats stats
+        if self._runs is not NULL:
+            self._runs.get_stats(stats)
+            return _stats_dict(stats, self._runs.stats_enabled())
+        self._tree.get_stats(stats)
+        return _stats_dict(stats, self._tree.stats_enabled())
+
+    def add(self, elem):
+        '''Add an occurrence of `elem` to the multiset.'''
+        _hash = hash(elem)
+        if self._runs is not NULL:
+            self._runs.add_obj(elem)
+        else:
+            self._tree.add_obj_multi(elem)
+        self._num_nodes += 1
+
+    def update(self, iterable = None):
+        '''Add every element of `iterable` to the multiset.'''
+        if iterable:
+            for elem in iterable:
+                self.add(elem)
+
+    def count(self, elem):
+        '''Return the number of occurrences of `elem` in the multiset.'''
+        _hash = hash(elem)
+        if self._runs is not NULL:
+            return self._runs.count_obj(elem)
+        return self._tree.count_obj(elem)
+
+    def equal_range(self, elem):
+        '''
+        Return a list of the elements equal to `elem`, in the order in
+        which they were added.
+        '''
+        _hash = hash(elem)
+        cdef ObjectRBTreeIterator it
+        cdef ObjectRBTreeIterator last
+        cdef CountRBTreeIterator rit
+        if self._runs is not NULL:
+            rit = self._runs.find_obj(elem)
+            if not rit.valid():
+                return []
+            return ([<object>dereference(rit).obj] *
+                    <Py_ssize_t>dereference(rit).count)
+        rv = []
+        it = self._tree.lower_bound_obj(elem)
+        last = self._tree.upper_bound_obj(elem)
+        while it != last:
+            rv.append(<object>dereference(it))
+            preincrement(it)
+        return rv
+
+    def remove(self, elem):
+        '''
+        Remove one occurrence of `elem` (the first one added) from the
+        multiset. Raises `KeyError` if `elem` is not contained in the
+        multiset.
+        '''
+        if not self.discard(elem):
+            raise KeyError(elem)
+
+    def discard(self, elem):
+        '''
+        Remove one occurrence of `elem` from the multiset if it is
+        present. Returns `True` if an element was removed.
+        '''
+        _hash = hash(elem)
+        cdef bool removed
+        if self._runs is not NULL:
+            removed = self._runs.del_obj(elem)
+        else:
+            removed = self._tree.del_obj_first(elem)
+        if removed:
+            self._num_nodes -= 1
+        return removed
+
+    def remove_all(self, elem):
+        '''
+        Remove every occurrence of `elem` from the multiset and return
+        the number of elements removed.
+        '''
+        _hash = hash(elem)
+        cdef size_t count
+        if self._runs is not NULL:
+            count = self._runs.del_obj_all(elem)
+        else:
+            count = self._tree.del_obj_all(elem)
+        self._num_nodes -= count
+        return count
+
+    def pop(self):
+        '''
+        Remove and return the smallest element. Raises `KeyError` if the
+        multiset is empty.
+        '''
+        cdef object obj = None
+        cdef bool popped
+        if self._runs is not NULL:
+            popped = self._runs.pop_first_save_obj(obj)
+        else:
+            popped = self._tree.pop_first_save_obj(obj)
+        if popped:
+            self._num_nodes -= 1
+            return obj
+        raise KeyError('pop from an empty multiset')
+
+    def clear(self, incremental = False):
+        '''
+        Remove all elements from the multiset. With
+        `incremental=True`, this takes constant time: the elements are
+        released a few at a time by later updates, or by `drain()`.
+        '''
+        self._num_nodes = 0
+        if self._runs is not NULL:
+            if incremental:
+                self._runs.clear_objs_incremental()
+            else:
+                self._runs.clear_objs()
+        elif incremental:
+            self._tree.clear_objs_incremental()
+        else:
+            self._tree.clear_objs()
+
+    def drain(self, n = None):
+        '''
+        Free up to `n` (by default, all) of the elements left behind by
+        `clear(incremental=True)`, and return the number of tree nodes
+        freed; 0 means that nothing is left.
+        '''
+        if self._runs is not NULL:
+            return self._runs.drain_objs(_drain_limit(n))
+        return self._tree.drain_objs(_drain_limit(n))
+
+    def copy(self):
+        '''Return a shallow copy of the multiset.'''
+        return type(self)(self, self.runlength)
+
+
+cdef class rbmultimap(object):
+    '''
+    Red-black-tree-based associative array that may map a key to
+    several values. Items with equal keys are kept in the order in
+    which they were added.
+    '''
+
+    cdef PairRBTree *_tree
+    cdef int _num_nodes
+
+    def __cinit__(self):
+        '''C Constructor.'''
+        self._tree = new PairRBTree()
+        self._num_nodes = 0
+
+    def __init__(self, items = None):
+        '''
+        Python Constructor. `items` is a mapping or an iterable of
+        `(key, value)` pairs.
+        '''
+        self.update(items)
+
+    def __dealloc__(self):
+        '''Destructor.'''
+        if self._tree is not NULL:
+            self._tree.clear_objs()
+            del self._tree
+
+    def __len__(self):
+        '''Return the number of items in the multimap.'''
+        return self._num_nodes
+
+    def __reduce__(self):
+        '''Support for pickling.'''
+        return (type(self), (list(self.iteritems()),))
+
+    def __contains__(self, key):
+        '''Return `True` if the multimap has a key `key`, else `False`.'''
+        return self.count(key) > 0
+
+    def __getitem__(self, key):
+        '''
+        Return a list of the values associated with `key`, in the order
+        in which they were added. Raises a `KeyError` if `key` is not in
+        the multimap.
+        '''
+        values = [value for (_key, value) in self.equal_range(key)]
+        if not values:
+            raise KeyError(key)
+        return values
+
+    def __delitem__(self, key):
+        '''
+        Removes all items with key `key`. Raises a `KeyError` if `key` is
+        not in the multimap.
+        '''
+        if not self.remove_all(key):
+            raise KeyError(key)
+
+    def __iter__(self):
+        '''Return an iterator over the keys (with repetitions).'''
+        return self.iterkeys()
+
+    def stats(self):
+        '''Return a dictionary describing the tree; see `rbdict.stats()`.'''
+        cdef RedBlackTreeStats stats
+        self._tree.get_stats(stats)
+        return _stats_dict(stats, self._tree.stats_enabled())
+
+    def add(self, key, value):
+        '''Associate `value` with `key`, in addition to any existing values.'''
+        _hash = hash(key)
+        self._tree.add_item_multi(key, value)
+        self._num_nodes += 1
+
+    def update(self, items = None):
+        '''
+        Add the items from `items`, which is a mapping or an iterable of
+        `(key, value)` pairs.
+        '''
+        if items is None:
+            return
+        if hasattr(items, 'items'):
+            items = items.items()
+        for key, value in items:
+            self.add(key, value)
+
+    def count(self, key):
+        '''Return the number of items with key `key`.'''
+        _hash = hash(key)
+        return self._tree.count_key(key)
+
+    def equal_range(self, key):
+        '''
+        Return a list of the `(key, value)` pairs with a key equal to
+        `key`, in the order in which they were added.
+        '''
+        _hash = hash(key)
+        cdef PairRBTreeIterator it = self._tree.lower_bound_key(key)
+        cdef PairRBTreeIterator last = self._tree.upper_bound_key(key)
+        rv = []
+        while it != last:
+            rv.append((<object>dereference(it).getFirst(),
+                       <object>dereference(it).getSecond()))
+            preincrement(it)
+        return rv
+
+    def remove(self, key):
+        '''
+        Remove the first-added item with key `key` and return its value.
+        Raises a `KeyError` if `key` is not in the multimap.
+        '''
+        _hash = hash(key)
+        cdef object value = None
+        if self._tree.del_key_first_save_value(key, value):
+            self._num_nodes -= 1
+            return value
+        raise KeyError(key)
+
+    def remove_all(self, key):
+        '''
+        Remove every item with key `key` and return the number of items
+        removed.
+        '''
+        _hash = hash(key)
+        cdef size_t count = self._tree.del_key_all(key)
+        self._num_nodes -= count
+        return count
+
+    def keys(self):
+        '''Return the keys (with repetitions) in sorted order.'''
+        if PYTHON_VERSION2 == 1:
+            return list(self.iterkeys())
+        else:
+            return self.iterkeys()
+
+    def values(self):
+        '''Return the values, in the order of their keys.'''
+        if PYTHON_VERSION2 == 1:
+            return list(self.itervalues())
+        else:
+            return self.itervalues()
+
+    def items(self):
+        '''Return the `(key, value)` pairs in sorted order.'''
+        if PYTHON_VERSION2 == 1:
+            return list(self.iteritems())
+        else:
+            return self.iteritems()
+
+    def iterkeys(self):
+        '''Return an iterator over the multimap’s keys.'''
+        cdef PairRBTreeIterator it = self._tree.begin()
+        while it != self._tree.end():
+            yield <object>dereference(it).getFirst()
+            preincrement(it)
+
+    def itervalues(self):
+        '''Return an iterator over the multimap’s values.'''
+        cdef PairRBTreeIterator it = self._tree.begin()
+        while it != self._tree.end():
+            yield <object>dereference(it).getSecond()
+            preincrement(it)
+
+    def iteritems(self):
+        '''Return an iterator over the multimap’s `(key, value)` pairs.'''
+        cdef PairRBTreeIterator it = self._tree.begin()
+        while it != self._tree.end():
+            yield (<object>dereference(it).getFirst(),
+                   <object>dereference(it).getSecond())
+            preincrement(it)
+
+    def popitem(self):
+        '''
+        Remove and return the `(key, value)` pair with the smallest key
+        (the first-added one, if there are several).
+        '''
+        cdef object key = None
+        cdef object value = None
+        if self._tree.pop_first_save_item(key, value):
+            self._num_nodes -= 1
+            return (key, value)
+        raise KeyError('popitem(): multimap is empty')
+
+    def clear(self, incremental = False):
+        '''
+        Remove all items from the multimap. With `incremental=True`,
+        this takes constant time: the items are released a few at a
+        time by later updates, or by `drain()`.
+        '''
+        self._num_nodes = 0
+        if incremental:
+            self._tree.clear_objs_incremental()
+        else:
+            self._tree.clear_objs()
+
+    def drain(self, n = None):
+        '''
+        Free up to `n` (by default, all) of the items left behind by
+        `clear(incremental=True)`, and return the number of tree nodes
+        freed; 0 means that nothing is left.
+        '''
+        return self._tree.drain_objs(_drain_limit(n))
+
+    def copy(self):
+        '''Return a shallow copy of the multimap.'''
+        return type(self)(self.iteritems())
+
+
+cdef class rbmerge(object):
+    '''
+    Iterator over several `rbset` or several `rbdict` objects in
+    global sorted order; see `merge()`.
+    '''
+
+    cdef ObjectRBMerge *_objs
+    cdef PairRBMerge *_pairs
+    cdef list _trees
+    cdef bool _reverse
+
+    def __cinit__(self, trees, dedupe = False, reverse = False,
+                  lo = None, hi = None):
+        '''C Constructor.'''
+        self._trees = list(trees)
+        self._reverse = reverse
+        cdef PyObject *lo_p = NULL
+        cdef PyObject *hi_p = NULL
+        if lo is not None:
+            _hash = hash(lo)
+            lo_p = <PyObject*>lo
+        if hi is not None:
+            _hash = hash(hi)
+            hi_p = <PyObject*>hi
+        if self._trees and all(isinstance(tree, rbdict)
+                               for tree in self._trees):
+            self._pairs = new PairRBMerge(dedupe, reverse)
+            for tree in self._trees:
+                (<rbdict>tree)._flush()
+                self._pairs.add_tree((<rbdict>tree)._tree, lo_p, hi_p)
+        elif all(isinstance(tree, rbset) for tree in self._trees):
+            self._objs = new ObjectRBMerge(dedupe, reverse)
+            for tree in self._trees:
+                self._objs.add_tree((<rbset>tree)._tree, lo_p, hi_p)
+        else:
+            raise TypeError('merge() needs either rbsets or rbdicts')
+
+    def __dealloc__(self):
+        '''Destructor.'''
+        if self._objs is not NULL:
+            del self._objs
+        if self._pairs is not NULL:
+            del self._pairs
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        '''Return the next element (or `(key, value)` pair).'''
+        cdef PyObject *key = NULL
+        cdef PyObject *value = NULL
+        if self._pairs is not NULL:
+            if self._pairs.next_item(key, value):
+                return (<object>key, <object>value)
+        elif self._objs.next_obj(key):
+            return <object>key
+        raise StopIteration
+
+    def to_tree(self):
+        '''
+        Return a new `rbset` (or `rbdict`) holding the remaining
+        elements (items), built in linear time. Where several have
+        equal keys, only the one from the earliest tree is kept, even
+        if the merge was not deduplicated.
+        '''
+        cdef rbset rvset
+        cdef rbdict rvdict
+        if self._pairs is not NULL:
+            rvdict = rbdict()
+            rvdict._num_nodes = self._pairs.drain_into(rvdict._tree,
+                                                       self._reverse)
+            return rvdict
+        rvset = rbset()
+        rvset._num_nodes = self._objs.drain_into(rvset._tree, self._reverse)
+        return rvset
+
+
+def merge(*trees, dedupe = False, reverse = False, lo = None, hi = None):
+    '''
+    Iterate over several `rbset` objects, or several `rbdict` objects,
+    at once in global sorted order (descending if `reverse` is true),
+    yielding elements or `(key, value)` pairs. Only keys `k` with
+    `lo <= k < hi` are included if `lo` and/or `hi` are given.
+
+    Elements with equal keys are yielded in the order in which their
+    trees were passed; with `dedupe`, only the first of them is
+    yielded. Call `to_tree()` on the result to collect it into a new
+    `rbset` or `rbdict`. The trees must not be modified while the
+    merge is in progress.
+    '''
+    return rbmerge(trees, dedupe, reverse, lo, hi)
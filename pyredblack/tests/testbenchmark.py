@@ -0,0 +1,42 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+testbenchmark.py
+
+Smoke tests for the pyredblack.benchmark suite.
+'''
+
+import json
+import unittest
+from .. import benchmark
+
+class TestBenchmark(unittest.TestCase):
+
+    def test_run(self):
+        report = benchmark.run([20], ['int', 'str', 'tuple'], repeat=1)
+        json.dumps(report)
+        impls = set(row['impl'] for row in report['results'])
+        self.assertEqual(impls, set(impl.name for impl in
+                                    benchmark.IMPLEMENTATIONS))
+        ops = set(row['op'] for row in report['results'])
+        for op in ['construct', 'lookup', 'iterate_ordered', 'memory',
+                   'build_and_popmin', 'union']:
+            self.assertTrue(op in ops)
+
+    def test_ordered_agree(self):
+        keys = benchmark.make_keys('tuple', 50)
+        results = [impl.ordered(impl.build(keys))
+                   for impl in benchmark.IMPLEMENTATIONS
+                   if impl.kind == 'set']
+        for result in results:
+            self.assertEqual(result, sorted(keys))
+
+    def test_compare(self):
+        report = benchmark.run([10], ['int'], impl_names=['rbset'], repeat=1)
+        slower = json.loads(json.dumps(report))
+        for row in slower['results']:
+            if 'seconds' in row:
+                row['seconds'] *= 2
+        self.assertEqual(benchmark.compare(report, slower, 0.1), [])
+        self.assertTrue(len(benchmark.compare(slower, report, 0.1)) > 0)
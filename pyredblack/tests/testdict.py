@@ -8,10 +8,16 @@ testdict.py
 Unit tests for the redblack.rbdict class.
 '''
 
+import pickle
 import random
 import unittest
 from .. import redblack
 
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
 class TestDict(unittest.TestCase):
 
     @unittest.expectedFailure
@@ -142,3 +148,353 @@ class TestDict(unittest.TestCase):
         (k, v) = d.popitem()
         self.assertEqual(k, 'Bulgaria')
         self.assertEqual(v, 'Sofia')
+
+    def test_pickle(self):
+        d1 = dict((random.randint(0, 10000), str(i)) for i in range(1000))
+        d2 = redblack.rbdict(d1)
+        d3 = pickle.loads(pickle.dumps(d2))
+        self.assertEqual(len(d3), len(d1))
+        self.assertEqual(list(d3.items()), sorted(d1.items()))
+        d3[-1] = 'new'
+        self.assertEqual(d3[-1], 'new')
+
+    def test_copy(self):
+        d1 = redblack.rbdict(one=1, two=2, three=3)
+        d2 = d1.copy()
+        d1['four'] = 4
+        self.assertEqual(list(d2.items()),
+                         [('one', 1), ('three', 3), ('two', 2)])
+
+    def test_stats(self):
+        d = redblack.rbdict()
+        self.assertEqual(d.stats()['nodes'], 0)
+        self.assertEqual(d.stats()['depth_histogram'], [])
+        for i in range(100):
+            d[i] = i
+        for i in range(0, 100, 2):
+            del d[i]
+        stats = d.stats()
+        self.assertEqual(stats['nodes'], 50)
+        if stats['counters_enabled']:
+            self.assertEqual(sum(stats['insert_fixup'].values()) > 0, True)
+            self.assertEqual(sum(stats['remove_fixup'].values()) >= 50, True)
+
+    def test_maxlen(self):
+        d = redblack.rbdict(((i, str(i)) for i in range(100)), maxlen=5)
+        self.assertEqual(list(d.items()),
+                         [(i, str(i)) for i in range(95, 100)])
+        # a new key below the smallest one is rejected; an equal key
+        # overwrites its value
+        d[0] = 'zero'
+        d[95] = 'new'
+        self.assertEqual(list(d.keys()), [95, 96, 97, 98, 99])
+        self.assertEqual(d[95], 'new')
+        d[200] = 'big'
+        self.assertEqual(list(d.keys()), [96, 97, 98, 99, 200])
+        d = redblack.rbdict({'a': 1, 'b': 2, 'c': 3}, maxlen=2, evict='max')
+        self.assertEqual(list(d.items()), [('a', 1), ('b', 2)])
+        d2 = pickle.loads(pickle.dumps(d))
+        self.assertEqual((d2.maxlen, d2.evict), (2, 'max'))
+        self.assertEqual(d2.copy().maxlen, 2)
+        self.assertEqual(redblack.rbdict(maxlen=None, x=1).maxlen, None)
+        self.assertRaises(ValueError, redblack.rbdict, maxlen=-3)
+
+    def test_setdefault(self):
+        d = redblack.rbdict({1: 'a'})
+        self.assertEqual(d.setdefault(1, 'b'), 'a')
+        self.assertEqual(d.setdefault(2, 'b'), 'b')
+        self.assertEqual(d.setdefault(3), None)
+        self.assertEqual(list(d.items()), [(1, 'a'), (2, 'b'), (3, None)])
+
+    def test_increment(self):
+        words = [random.choice('abcdefg') for _i in range(1000)]
+        d = redblack.rbdict()
+        for word in words:
+            d.increment(word)
+        self.assertEqual(dict(d.items()),
+                         dict((w, words.count(w)) for w in set(words)))
+        self.assertEqual(len(d), len(set(words)))
+        self.assertEqual(d.increment('a', 0.5), words.count('a') + 0.5)
+        self.assertEqual(d.increment('z', 2, 10), 12)
+        d['s'] = 'x'
+        self.assertRaises(TypeError, d.increment, 's')
+        self.assertEqual(d['s'], 'x')
+
+    def test_get_or_insert(self):
+        d = redblack.rbdict()
+        calls = []
+        def factory():
+            calls.append(1)
+            return []
+        d.get_or_insert(-1, factory).append(1)
+        d.get_or_insert(-1, factory).append(2)
+        self.assertEqual(d[-1], [1, 2])
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(len(d), 1)
+        def failing():
+            raise RuntimeError
+        self.assertRaises(RuntimeError, d.get_or_insert, -2, failing)
+        self.assertEqual(-2 in d, False)
+        # a factory that itself changes the dictionary
+        def meddling():
+            for i in range(20):
+                d[i] = i
+            return 'm'
+        self.assertEqual(d.get_or_insert(5.5, meddling), 'm')
+        self.assertEqual(len(d), 22)
+        self.assertEqual(list(d.keys())[:8], [-1, 0, 1, 2, 3, 4, 5, 5.5])
+
+    def test_update_with(self):
+        d = redblack.rbdict(a=1)
+        self.assertEqual(d.update_with('a', lambda v: v * 10), 10)
+        self.assertEqual(d.update_with('b', lambda v: v + [1], []), [1])
+        self.assertEqual(list(d.items()), [('a', 10), ('b', [1])])
+        def remove_self(v):
+            del d['a']
+            return v + 1
+        self.assertEqual(d.update_with('a', remove_self), 11)
+        self.assertEqual(d['a'], 11)
+        self.assertEqual(len(d), 2)
+        d = redblack.rbdict(maxlen=2)
+        for key in 'abcab':
+            d.increment(key)
+        self.assertEqual(list(d.items()), [('b', 2), ('c', 1)])
+
+    def test_digest(self):
+        items = [(i, str(i)) for i in range(500)]
+        random.shuffle(items)
+        d1 = redblack.rbdict(items)
+        random.shuffle(items)
+        d2 = redblack.rbdict()
+        d2.enable_digests()
+        for key, value in items:
+            d2[key] = value
+        self.assertEqual(d1.digests_enabled, False)
+        self.assertEqual(d2.digests_enabled, True)
+        # same contents, different shapes
+        self.assertEqual(d1.digest(), d2.digest())
+        self.assertEqual(d1.digest(100, 200), d2.digest(100, 200))
+        self.assertEqual(d1.digest(100, 200),
+                         redblack.rbdict((i, str(i))
+                                         for i in range(100, 200)).digest())
+        self.assertEqual(d1.digest(100, 200) + d1.digest(200) & (2**64 - 1),
+                         d1.digest(100))
+        self.assertEqual(redblack.rbdict().digest(), 0)
+        d2[5] = 'five'
+        self.assertNotEqual(d1.digest(), d2.digest())
+        self.assertEqual(d1.digest(6), d2.digest(6))
+        d2[5] = '5'
+        self.assertEqual(d1.digest(), d2.digest())
+        # maintained by removals, bulk loads and compound updates
+        for i in range(0, 500, 3):
+            del d1[i]
+            del d2[i]
+        self.assertEqual(d1.digest(), d2.digest())
+        d3 = d2.copy()
+        self.assertEqual(d3.digests_enabled, True)
+        self.assertEqual(d3.digest(), d2.digest())
+        d3.increment(1000, 1)
+        d3.update_with(1000, lambda v: v)
+        d2.setdefault(1000, 1)
+        self.assertEqual(d3.digest(), d2.digest())
+
+    def test_diff(self):
+        d1 = redblack.rbdict((i, i) for i in range(2000))
+        d2 = redblack.rbdict((i, i) for i in reversed(range(2000)))
+        self.assertEqual(d1.diff(d2), [])
+        changed = sorted(random.sample(range(2000), 20))
+        for key in changed:
+            d2[key] = -1
+        del d1[changed[0]]
+        d1[5000] = 0
+        d2[-7] = [1, 2]
+        self.assertEqual(d1.diff(d2), [-7] + changed + [5000])
+        self.assertEqual(d2.diff(d1), [-7] + changed + [5000])
+        self.assertEqual(d1.diff(redblack.rbdict()), list(d1.keys()))
+        # equal but distinct values
+        a = redblack.rbdict({1: (1, 2)})
+        b = redblack.rbdict({1: (1, 2)})
+        self.assertEqual(a.diff(b), [])
+        # values hashed by identity, or equal but with unequal hashes
+        a = redblack.rbdict((i, [i]) for i in range(10))
+        self.assertEqual(a.diff(a.copy()), [])
+        a[3] = [-3]
+        self.assertEqual(a.diff(redblack.rbdict((i, [i]) for i in range(10))),
+                         [3])
+        class Same(object):
+            def __eq__(self, other):
+                return isinstance(other, Same)
+            __hash__ = object.__hash__
+        a = redblack.rbdict((i, Same()) for i in range(10))
+        b = redblack.rbdict((i, Same()) for i in range(10))
+        self.assertEqual(a.diff(b), [])
+
+    def test_buffer_writes(self):
+        reference = {}
+        d = redblack.rbdict((i, i) for i in range(0, 300, 2))
+        reference.update((i, i) for i in range(0, 300, 2))
+        d.buffer_writes(50)
+        self.assertEqual(d.write_buffer, 50)
+        for _i in range(2000):
+            key = random.randint(0, 400)
+            if random.random() < 0.3:
+                if key in reference:
+                    del d[key]
+                    del reference[key]
+                else:
+                    self.assertRaises(KeyError, d.__delitem__, key)
+            else:
+                d[key] = -key
+                reference[key] = -key
+            # lookups see buffered writes
+            probe = random.randint(0, 400)
+            self.assertEqual(probe in d, probe in reference)
+            self.assertEqual(d.get(probe), reference.get(probe))
+            if probe in reference:
+                self.assertEqual(d[probe], reference[probe])
+        self.assertEqual(len(d), len(reference))
+        self.assertEqual(list(d.items()), sorted(reference.items()))
+        self.assertEqual(d.stats()['nodes'], len(reference))
+        # a batch larger than the tree is merged in one pass
+        d.clear()
+        for i in reversed(range(1000)):
+            d[i] = str(i)
+        del d[500]
+        self.assertEqual(list(d.keys()), [i for i in range(1000) if i != 500])
+        d.buffer_writes(0)
+        self.assertEqual(d.write_buffer, 0)
+        d[5000] = 'x'
+        self.assertEqual(len(d), 1000)
+        self.assertRaises(ValueError, redblack.rbdict(maxlen=3).buffer_writes, 10)
+        # small batches against a large tree take the finger-search path
+        reference = dict((i, i) for i in range(0, 4000, 2))
+        d = redblack.rbdict(reference)
+        d.buffer_writes(16)
+        for _i in range(1000):
+            key = random.randint(-10, 4010)
+            if key in reference and random.random() < 0.2:
+                del d[key]
+                del reference[key]
+            else:
+                d[key] = str(key)
+                reference[key] = str(key)
+        self.assertEqual(list(d.items()), sorted(reference.items()))
+        self.assertEqual(len(d), len(reference))
+
+    def test_buffer_writes_digests(self):
+        d1 = redblack.rbdict((i, i) for i in range(1000))
+        d2 = d1.copy()
+        d1.enable_digests()
+        d1.buffer_writes(100)
+        for i in range(0, 1000, 7):
+            d1[i] = 'new'
+            d2[i] = 'new'
+        for i in range(0, 1000, 11):
+            del d1[i]
+            del d2[i]
+        self.assertEqual(d1.diff(d2), [])
+        self.assertEqual(d1.digest(), d2.digest())
+
+    def test_clear_incremental(self):
+        import sys
+        value = object()
+        refs = sys.getrefcount(value)
+        d = redblack.rbdict((i, value) for i in range(1000))
+        d.clear(incremental=True)
+        self.assertEqual(len(d), 0)
+        self.assertEqual(sys.getrefcount(value), refs + 1000)
+        self.assertEqual(d.drain(10), 10)
+        self.assertEqual(sys.getrefcount(value), refs + 990)
+        # updates release a few nodes each
+        d['a'] = 1
+        self.assertEqual(sys.getrefcount(value), refs + 990 - 64)
+        # and so do compound updates
+        d.increment('b', 1)
+        self.assertEqual(sys.getrefcount(value), refs + 990 - 2 * 64)
+        d.setdefault('c', 1)
+        d.get_or_insert('d', int)
+        d.update_with('a', lambda v: v + 1)
+        self.assertEqual(sys.getrefcount(value), refs + 990 - 5 * 64)
+        d.clear(incremental=True)
+        self.assertEqual(d.drain(), 990 - 5 * 64 + 4)
+        self.assertEqual(sys.getrefcount(value), refs)
+        # a full clear also frees what an incremental one left behind
+        d.update((i, value) for i in range(100))
+        d.clear(incremental=True)
+        d.clear()
+        self.assertEqual(d.drain(), 0)
+        self.assertEqual(sys.getrefcount(value), refs)
+
+    def test_clear_reentrant(self):
+        # objects released by clear() may update the dictionary
+        class Readd(object):
+            def __init__(self, d, key):
+                self.d = d
+                self.key = key
+            def __del__(self):
+                if self.key[0] == 'a':
+                    self.d[('b', self.key[1])] = None
+        for incremental in (False, True):
+            d = redblack.rbdict()
+            for i in range(100):
+                d[('a', i)] = Readd(d, ('a', i))
+            d.clear(incremental)
+            d.drain()
+            self.assertEqual(len(d), 100)
+            self.assertEqual(list(d.keys()), [('b', i) for i in range(100)])
+
+    def test_keys_array(self):
+        d = redblack.rbdict((i, i / 2.0) for i in range(100, 0, -1))
+        keys = d.keys_array()
+        self.assertEqual(keys.format, 'q')
+        view = memoryview(keys)
+        self.assertEqual(view.format, 'q')
+        self.assertTrue(view.readonly)
+        self.assertEqual(view.tolist(), list(range(1, 101)))
+        values = d.values_array(10, 20)
+        self.assertEqual(values.format, 'd')
+        self.assertEqual(memoryview(values).tolist(),
+                         [i / 2.0 for i in range(10, 20)])
+        self.assertEqual(d.keys_array(hi=4).tolist(), [1, 2, 3])
+        self.assertEqual(d.keys_array(98).tolist(), [98, 99, 100])
+        self.assertEqual(len(d.keys_array(50, 50)), 0)
+        self.assertEqual(len(memoryview(redblack.rbdict().keys_array())), 0)
+        # anything else is exported as object references
+        self.assertEqual(redblack.rbdict({2 ** 70: 1, 1: 2}).keys_array().format,
+                         'O')
+        self.assertEqual(redblack.rbdict({1: 1, 1.5: 2}).keys_array().format,
+                         'O')
+        d = redblack.rbdict((str(i), [i]) for i in range(10))
+        values = d.values_array()
+        self.assertEqual(values.format, 'O')
+        self.assertEqual(memoryview(values).format, 'O')
+        self.assertEqual(list(values), [[i] for i in range(10)])
+        self.assertEqual(values[-1], [9])
+        del d
+        self.assertEqual(values.tolist(), [[i] for i in range(10)])
+
+    def test_from_arrays(self):
+        d1 = redblack.rbdict((i, str(i)) for i in range(100))
+        d2 = redblack.rbdict.from_arrays(d1.keys_array(), d1.values_array())
+        self.assertEqual(list(d2.items()), list(d1.items()))
+        self.assertEqual(d2.diff(d1), [])
+        import array
+        d3 = redblack.rbdict.from_arrays(array.array('q', [1, 2, 3]),
+                                         array.array('d', [0.5, 1.5, 2.5]))
+        self.assertEqual(list(d3.items()), [(1, 0.5), (2, 1.5), (3, 2.5)])
+        self.assertTrue(all(type(k) is int for k in d3.keys()))
+        # unsorted keys are inserted one at a time
+        d4 = redblack.rbdict.from_arrays([3, 1, 2], 'abc')
+        self.assertEqual(list(d4.items()), [(1, 'b'), (2, 'c'), (3, 'a')])
+        self.assertRaises(ValueError, redblack.rbdict.from_arrays, [1, 2], [1])
+
+    @unittest.skipIf(numpy is None, 'NumPy is not installed')
+    def test_numpy_arrays(self):
+        d = redblack.rbdict((i, i * 0.25) for i in range(50))
+        keys = numpy.asarray(d.keys_array())
+        self.assertEqual(keys.dtype, numpy.int64)
+        self.assertEqual(keys.tolist(), list(range(50)))
+        self.assertEqual(numpy.asarray(d.values_array()).dtype, numpy.float64)
+        d2 = redblack.rbdict.from_arrays(numpy.arange(50),
+                                         numpy.arange(50) * 0.25)
+        self.assertEqual(list(d2.items()), list(d.items()))
@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+testmerge.py
+
+Unit tests for k-way merges of rbsets and rbdicts.
+'''
+
+import heapq
+import random
+import unittest
+from .. import merge, redblack
+
+def make_sets(count, size):
+    '''Return `count` random lists of distinct integers.'''
+    return [random.sample(range(size * 3), size) for _i in range(count)]
+
+class TestMerge(unittest.TestCase):
+
+    def test_sets(self):
+        for count in (1, 2, 3, 5, 8):
+            lists = make_sets(count, 100)
+            trees = [redblack.rbset(l) for l in lists]
+            expected = list(heapq.merge(*[sorted(l) for l in lists]))
+            self.assertEqual(list(merge(*trees)), expected)
+            self.assertEqual(list(merge(*trees, reverse=True)),
+                             expected[::-1])
+            self.assertEqual(list(merge(*trees, dedupe=True)),
+                             sorted(set(expected)))
+
+    def test_empty(self):
+        self.assertEqual(list(merge()), [])
+        self.assertEqual(list(merge(redblack.rbset(),
+                                               redblack.rbset([1]))), [1])
+        self.assertEqual(len(merge().to_tree()), 0)
+
+    def test_range(self):
+        lists = make_sets(4, 50)
+        trees = [redblack.rbset(l) for l in lists]
+        everything = sorted(x for l in lists for x in l)
+        for lo, hi in ((None, None), (10, 100), (None, 40), (40, None),
+                       (-5, 0), (75, 75), (80, 20), (0, 1000)):
+            expected = [x for x in everything
+                        if (lo is None or lo <= x) and (hi is None or x < hi)]
+            self.assertEqual(list(merge(*trees, lo=lo, hi=hi)),
+                             expected)
+            self.assertEqual(list(merge(*trees, lo=lo, hi=hi,
+                                                   reverse=True)),
+                             expected[::-1])
+
+    def test_dicts(self):
+        a = redblack.rbdict({1: 'a1', 3: 'a3', 5: 'a5'})
+        b = redblack.rbdict({1: 'b1', 2: 'b2', 5: 'b5'})
+        self.assertEqual(list(merge(a, b)),
+                         [(1, 'a1'), (1, 'b1'), (2, 'b2'), (3, 'a3'),
+                          (5, 'a5'), (5, 'b5')])
+        self.assertEqual(list(merge(b, a, dedupe=True,
+                                               reverse=True)),
+                         [(5, 'b5'), (3, 'a3'), (2, 'b2'), (1, 'b1')])
+        merged = merge(a, b, dedupe=True).to_tree()
+        self.assertEqual(type(merged), redblack.rbdict)
+        self.assertEqual(list(merged.items()),
+                         [(1, 'a1'), (2, 'b2'), (3, 'a3'), (5, 'a5')])
+        self.assertEqual(len(merged), 4)
+        merged[4] = 'new'
+        self.assertEqual(len(merged), 5)
+
+    def test_to_tree(self):
+        lists = make_sets(3, 200)
+        trees = [redblack.rbset(l) for l in lists]
+        merged = merge(*trees, dedupe=True, reverse=True).to_tree()
+        self.assertEqual(list(merged), sorted(set(sum(lists, []))))
+        self.assertEqual(len(merged), len(set(sum(lists, []))))
+        self.assertEqual(merged.stats()['nodes'], len(merged))
+        # partially consumed
+        it = merge(*trees, dedupe=True)
+        first = next(it)
+        self.assertEqual(min(merged), first)
+        self.assertEqual(list(it.to_tree()), list(merged)[1:])
+
+    def test_to_tree_without_dedupe(self):
+        merged = merge(redblack.rbset([1, 2, 3]),
+                       redblack.rbset([2, 3, 4])).to_tree()
+        self.assertEqual(list(merged), [1, 2, 3, 4])
+        self.assertEqual(len(merged), 4)
+        merged.remove(3)
+        self.assertFalse(3 in merged)
+        for reverse in (False, True):
+            a = redblack.rbdict({1: 'a1', 2: 'a2'})
+            b = redblack.rbdict({2: 'b2', 3: 'b3'})
+            merged = merge(a, b, reverse=reverse).to_tree()
+            self.assertEqual(list(merged.items()),
+                             [(1, 'a1'), (2, 'a2'), (3, 'b3')])
+            self.assertEqual(len(merged), 3)
+
+    def test_mixed(self):
+        self.assertRaises(TypeError, merge, redblack.rbset(),
+                          redblack.rbdict())
+        self.assertRaises(TypeError, merge, [1, 2])
+
+if __name__ == '__main__':
+    unittest.main()
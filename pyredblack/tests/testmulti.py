@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+testmulti.py
+
+Unit tests for the redblack.rbmultiset and redblack.rbmultimap
+classes.
+'''
+
+import pickle
+import random
+import unittest
+from .. import redblack
+
+class TestMultiset(unittest.TestCase):
+
+    def check_ops(self, runlength):
+        for _try in range(10):
+            counts = {}
+            s = redblack.rbmultiset(runlength=runlength)
+            for _iter in range(2000):
+                num = random.randint(0, 100)
+                if random.randint(0, 2):
+                    s.add(num)
+                    counts[num] = counts.get(num, 0) + 1
+                else:
+                    removed = s.discard(num)
+                    self.assertEqual(removed, counts.get(num, 0) > 0)
+                    if removed:
+                        counts[num] -= 1
+            expected = sorted(num for num, count in counts.items()
+                              for _i in range(count))
+            self.assertEqual(len(s), len(expected))
+            self.assertEqual(list(s), expected)
+            for num in range(101):
+                self.assertEqual(s.count(num), counts.get(num, 0))
+                self.assertEqual(num in s, counts.get(num, 0) > 0)
+
+    def test_ops(self):
+        self.check_ops(False)
+
+    def test_ops_runlength(self):
+        self.check_ops(True)
+
+    def test_insertion_order(self):
+        # 1, 1.0 and True are equal but distinguishable
+        s = redblack.rbmultiset([2, 1, 1.0, 0, True, 1])
+        self.assertEqual([type(x) for x in s.equal_range(1)],
+                         [int, float, bool, int])
+        s.remove(1)
+        self.assertEqual([type(x) for x in s.equal_range(1)],
+                         [float, bool, int])
+        self.assertEqual(s.pop(), 0)
+        self.assertEqual(s.remove_all(1), 3)
+        self.assertEqual(list(s), [2])
+        self.assertRaises(KeyError, s.remove, 1)
+
+    def test_runlength(self):
+        s = redblack.rbmultiset('mississippi', runlength=True)
+        self.assertTrue(s.runlength)
+        self.assertEqual(''.join(s), 'iiiimppssss')
+        self.assertEqual(s.stats()['nodes'], 4)
+        self.assertEqual(s.remove_all('s'), 4)
+        self.assertEqual(s.pop(), 'i')
+        self.assertEqual(len(s), 6)
+        # a run holds the first-added object, not the probe
+        s = redblack.rbmultiset([1, 1.0, True], runlength=True)
+        self.assertEqual([type(x) for x in s.equal_range(1.0)],
+                         [int, int, int])
+        self.assertEqual(s.equal_range(5), [])
+
+    def test_pickle(self):
+        for runlength in (False, True):
+            s = redblack.rbmultiset([3, 1, 3, 2], runlength=runlength)
+            s2 = pickle.loads(pickle.dumps(s))
+            self.assertEqual(list(s2), [1, 2, 3, 3])
+            self.assertEqual(s2.runlength, runlength)
+            self.assertEqual(list(s.copy()), [1, 2, 3, 3])
+
+    def test_clear_incremental(self):
+        for runlength in (False, True):
+            s = redblack.rbmultiset('mississippi', runlength=runlength)
+            s.clear(incremental=True)
+            self.assertEqual(len(s), 0)
+            s.add('x')
+            self.assertEqual(list(s), ['x'])
+            self.assertEqual(s.drain(), 0)
+        m = redblack.rbmultimap((i % 10, i) for i in range(500))
+        m.clear(incremental=True)
+        self.assertEqual(m.drain(100), 100)
+        self.assertEqual(m.drain(), 400)
+        self.assertEqual(list(m.items()), [])
+
+
+class TestMultimap(unittest.TestCase):
+
+    def test_ops(self):
+        m = redblack.rbmultimap([('b', 1), ('a', 2), ('b', 3)])
+        m.add('a', 4)
+        m.add('c', 5)
+        self.assertEqual(len(m), 5)
+        self.assertEqual(list(m.keys()), ['a', 'a', 'b', 'b', 'c'])
+        self.assertEqual(m['a'], [2, 4])
+        self.assertEqual(m.count('b'), 2)
+        self.assertEqual(m.equal_range('b'), [('b', 1), ('b', 3)])
+        self.assertEqual(m.remove('b'), 1)
+        self.assertEqual(m['b'], [3])
+        del m['a']
+        self.assertFalse('a' in m)
+        self.assertRaises(KeyError, m.__getitem__, 'a')
+        self.assertRaises(KeyError, m.__delitem__, 'a')
+        self.assertEqual(m.popitem(), ('b', 3))
+        self.assertEqual(list(m.items()), [('c', 5)])
+
+    def test_random(self):
+        m = redblack.rbmultimap()
+        expected = []
+        for i in range(2000):
+            key = random.randint(0, 50)
+            m.add(key, i)
+            expected.append((key, i))
+        # a stable sort keeps equal keys in insertion order
+        expected.sort(key=lambda item: item[0])
+        self.assertEqual(list(m.items()), expected)
+        self.assertEqual(pickle.loads(pickle.dumps(m)).equal_range(7),
+                         [item for item in expected if item[0] == 7])
+        for key in range(0, 51, 2):
+            self.assertEqual(m.remove_all(key),
+                             len([item for item in expected if item[0] == key]))
+        self.assertEqual(list(m.items()),
+                         [item for item in expected if item[0] % 2])
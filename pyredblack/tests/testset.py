@@ -8,6 +8,7 @@ testset.py
 Unit tests for the redblack.rbdict class.
 '''
 
+import pickle
 import random
 import unittest
 from .. import redblack
@@ -131,3 +132,86 @@ class TestSet(unittest.TestCase):
             rv1 = getattr(a, op)(b)
             rv2 = getattr(redblack.rbset(a), op)(redblack.rbset(b))
             self.assertEqual(sorted(rv1), sorted(rv2))
+
+    def test_pickle(self):
+        a = make_random_set()
+        s = redblack.rbset(a)
+        s2 = pickle.loads(pickle.dumps(s))
+        self.assertEqual(len(s2), len(a))
+        self.assertEqual(list(s2), sorted(a))
+        # the unpickled tree must still accept updates
+        s2.add(-1)
+        s2.discard(max(a))
+        self.assertEqual(list(s2), [-1] + sorted(a)[:-1])
+
+    def test_setstate_unsorted(self):
+        s = redblack.rbset()
+        s.__setstate__((4, [3, 1, 2, 1]))
+        self.assertEqual(list(s), [1, 2, 3])
+        self.assertEqual(len(s), 3)
+
+    def test_copy(self):
+        a = make_random_set()
+        s = redblack.rbset(a)
+        s2 = s.copy()
+        s.clear()
+        self.assertEqual(list(s2), sorted(a))
+
+    def test_stats(self):
+        s = redblack.rbset(range(1000))
+        stats = s.stats()
+        self.assertEqual(stats['nodes'], 1000)
+        self.assertEqual(sum(stats['depth_histogram']), 1000)
+        self.assertEqual(len(stats['depth_histogram']), stats['max_depth'] + 1)
+        # a red-black tree is never more than twice as deep as a
+        # perfectly balanced one
+        self.assertTrue(stats['max_depth'] < 20)
+        if stats['counters_enabled']:
+            self.assertTrue(stats['comparisons'] > 0)
+            self.assertTrue(stats['rotations']['left'] > 0)
+
+    def test_clear_incremental(self):
+        s = redblack.rbset(range(1000))
+        s.clear(incremental=True)
+        self.assertEqual(len(s), 0)
+        self.assertEqual(list(s), [])
+        s.add(5)
+        self.assertEqual(list(s), [5])
+        # each update released some of the old nodes
+        freed = s.drain(100)
+        self.assertEqual(freed, 100)
+        self.assertEqual(s.drain(), 1000 - 64 - 100)
+        self.assertEqual(s.drain(), 0)
+        self.assertEqual(list(s), [5])
+        self.assertRaises(ValueError, s.drain, -1)
+
+    def test_maxlen(self):
+        a = [random.randint(0, 10000) for _i in range(2000)]
+        s = redblack.rbset(a, maxlen=10)
+        self.assertEqual(s.maxlen, 10)
+        self.assertEqual(s.evict, 'min')
+        self.assertEqual(list(s), sorted(set(a))[-10:])
+        self.assertEqual(len(s), 10)
+        # too small to keep: rejected
+        s.add(-1)
+        self.assertEqual(-1 in s, False)
+        self.assertEqual(len(s), 10)
+        s = redblack.rbset(a, maxlen=10, evict='max')
+        self.assertEqual(list(s), sorted(set(a))[:10])
+        s2 = pickle.loads(pickle.dumps(s))
+        self.assertEqual((s2.maxlen, s2.evict), (10, 'max'))
+        s2.add(-1)
+        self.assertEqual(list(s2), [-1] + sorted(set(a))[:9])
+        s3 = s.copy()
+        self.assertEqual((s3.maxlen, s3.evict, list(s3)),
+                         (10, 'max', list(s)))
+        self.assertEqual(len(redblack.rbset(a, maxlen=0)), 0)
+        self.assertRaises(ValueError, redblack.rbset, maxlen=-1)
+        self.assertRaises(ValueError, redblack.rbset, evict='middle')
+        # the cached first element stays correct under removal
+        s = redblack.rbset(range(100), maxlen=50)
+        for i in range(50, 60):
+            s.remove(i)
+        s.add(55)
+        self.assertEqual(s.pop(), 55)
+        self.assertEqual(s.pop(), 60)
@@ -1,6 +1,6 @@
 from setuptools import setup, find_packages, Extension
 from codecs import open  # To use a consistent encoding
-from os import path
+from os import path, environ
 import sys
 
 HERE = path.abspath(path.dirname(__file__))
@@ -22,9 +22,16 @@ try:
 except ImportError:
     pass
 
+# Operation counters for rbset.stats() and rbdict.stats() are only
+# compiled in when PYREDBLACK_STATS is set in the environment.
+DEFINE_MACROS = []
+if environ.get('PYREDBLACK_STATS'):
+    DEFINE_MACROS.append(('REDBLACK_STATS', None))
+
 PYREDBLACK_EXTENSIONS = [Extension(
     "pyredblack.redblack",
     ['pyredblack/redblack' + ('.pyx' if USE_CYTHON else '.cpp')],
+    define_macros=DEFINE_MACROS,
     language="c++")]
 if USE_CYTHON:
     PYREDBLACK_EXTENSIONS = cythonize(PYREDBLACK_EXTENSIONS)
@@ -116,11 +123,11 @@ setup(
     # To provide executable scripts, use entry points in preference to the
     # "scripts" keyword. Entry points provide cross-platform support and allow
     # pip to create the appropriate form of executable for the target platform.
-    #entry_points={
-    #    'console_scripts': [
-    #        'sample=sample:main',
-    #    ],
-    #},
+    entry_points={
+        'console_scripts': [
+            'pyredblack-bench=pyredblack.benchmark:main',
+        ],
+    },
     test_suite='nose.collector',
     tests_require=['nose'],
 )
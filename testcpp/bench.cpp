@@ -0,0 +1,424 @@
+// Microbenchmarks for RedBlackTree, with std::set and std::map as
+// baselines.
+//
+// Usage: bench [--sizes 1000,10000,...] [--orders seq,random,...]
+//              [--containers rbset,stdset,rbmap,stdmap]
+//
+// Prints one JSON object per line, e.g.
+//   {"container": "rbset", "order": "random", "size": 1000,
+//    "op": "find", "ops": 1000, "ns_per_op": 52.1,
+//    "cache_misses_per_op": 0.8}
+// size is the number of distinct keys in the tree, which for the
+// zipf order is below the requested size, as its keys repeat.
+// cache_misses_per_op is null where hardware counters are not
+// available; the "memory" op reports bytes_per_node instead.
+
+#include "pyredblack/redblack.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <set>
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <malloc.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // __linux__
+
+typedef long Key;
+
+// ======================================================================
+//  MEASUREMENT
+// ======================================================================
+
+// last-level cache misses of this thread, where perf counters exist
+class CacheMisses
+{
+public:
+    CacheMisses() : fd(-1)
+    {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif // __linux__
+    };
+    ~CacheMisses()
+    {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif // __linux__
+    };
+    bool available() const {return (fd >= 0);};
+    void start()
+    {
+#ifdef __linux__
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif // __linux__
+    };
+    long long stop()
+    {
+        long long count = 0;
+#ifdef __linux__
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+#endif // __linux__
+        return count;
+    };
+private:
+    int fd;
+};
+
+static CacheMisses *cache_misses = 0;
+
+// bytes currently allocated from the heap, or 0 if unknown
+static size_t heap_in_use()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+class Timer
+{
+public:
+    void start()
+    {
+        cache_misses->start();
+        begin = std::chrono::steady_clock::now();
+    };
+    void stop()
+    {
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        misses = cache_misses->stop();
+        ns = std::chrono::duration<double, std::nano>(end - begin).count();
+    };
+    double ns;
+    long long misses;
+private:
+    std::chrono::steady_clock::time_point begin;
+};
+
+static void report(const string &container, const string &order, size_t size,
+                   const string &op, size_t ops, const Timer &timer)
+{
+    cout << "{\"container\": \"" << container << "\", \"order\": \"" << order
+         << "\", \"size\": " << size << ", \"op\": \"" << op
+         << "\", \"ops\": " << ops << ", \"ns_per_op\": "
+         << fixed << setprecision(2) << (ops ? timer.ns / ops : 0.0)
+         << ", \"cache_misses_per_op\": ";
+    if (timer.misses < 0)
+        cout << "null";
+    else
+        cout << setprecision(3) << (ops ? (double)timer.misses / ops : 0.0);
+    cout << "}" << endl;
+}
+
+static void report_memory(const string &container, const string &order,
+                          size_t size, size_t nodes, double bytes)
+{
+    cout << "{\"container\": \"" << container << "\", \"order\": \"" << order
+         << "\", \"size\": " << size << ", \"op\": \"memory\", \"nodes\": "
+         << nodes << ", \"bytes_per_node\": ";
+    if (bytes > 0 && nodes)
+        cout << fixed << setprecision(2) << bytes / nodes;
+    else
+        cout << "null";
+    cout << "}" << endl;
+}
+
+// ======================================================================
+//  KEY ORDERS
+// ======================================================================
+
+static uint64_t mix(uint64_t x)
+{
+    // splitmix64 finaliser
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Zipfian ranks in [0, n) with skew theta (Gray et al., as used by
+// YCSB); needs O(n) time to set up but no memory
+class Zipf
+{
+public:
+    Zipf(size_t n, double theta) : n(n), theta(theta), state(1)
+    {
+        zetan = 0.0;
+        for (size_t i = 1; i <= n; ++i) zetan += 1.0 / pow((double)i, theta);
+        double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    };
+    size_t next()
+    {
+        state = mix(state);
+        double u = (state >> 11) * (1.0 / 9007199254740992.0);
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + pow(0.5, theta)) return 1;
+        size_t rv = (size_t)(n * pow(eta * u - eta + 1.0, alpha));
+        return (rv < n ? rv : n - 1);
+    };
+private:
+    size_t n;
+    double theta, zetan, alpha, eta;
+    uint64_t state;
+};
+
+// keys to insert, in the given order
+static vector<Key> make_keys(const string &order, size_t n)
+{
+    vector<Key> keys;
+    keys.reserve(n);
+    if (order == "seq")
+    {
+        for (size_t i = 0; i < n; ++i) keys.push_back(i);
+    }
+    else if (order == "random")
+    {
+        for (size_t i = 0; i < n; ++i) keys.push_back(i);
+        for (size_t i = n; i > 1; --i)
+            swap(keys[i - 1], keys[mix(i) % i]);
+    }
+    else if (order == "zipf")
+    {
+        // hot keys are scattered over the key space
+        Zipf zipf(n, 0.99);
+        for (size_t i = 0; i < n; ++i)
+            keys.push_back((Key)(mix(zipf.next()) >> 1));
+    }
+    else if (order == "adversarial")
+    {
+        // alternate between the two ends, so that every insert
+        // lands on the deepest path and rebalances at both edges
+        for (size_t i = 0; i < n; ++i)
+            keys.push_back(i % 2 ? (Key)(n - 1 - i / 2) : (Key)(i / 2));
+    }
+    return keys;
+}
+
+// ======================================================================
+//  CONTAINERS
+// ======================================================================
+
+struct RBSet
+{
+    static const char *name() {return "rbset";};
+    RedBlackTree<Key> t;
+    bool insert(Key k) {RedBlackTreeIterator<Key> it; return t.insert(k, it);};
+    bool find(Key k) {RedBlackTreeIterator<Key> it = t.find(k);
+        return it.valid() && it.getDir() == 0;};
+    bool remove(Key k) {Key out; return t.remove(k, out);};
+    Key iterate() {Key sum = 0;
+        for (RedBlackTreeIterator<Key> it = t.begin(); it != t.end(); ++it)
+            sum += *it;
+        return sum;};
+    Key first() {return *t.begin();};
+    void clear() {t.clear();};
+};
+
+struct StdSet
+{
+    static const char *name() {return "stdset";};
+    set<Key> t;
+    bool insert(Key k) {return t.insert(k).second;};
+    bool find(Key k) {return t.find(k) != t.end();};
+    bool remove(Key k) {return t.erase(k) != 0;};
+    Key iterate() {Key sum = 0;
+        for (set<Key>::iterator it = t.begin(); it != t.end(); ++it)
+            sum += *it;
+        return sum;};
+    Key first() {return *t.begin();};
+    void clear() {t.clear();};
+};
+
+typedef pair<Key, Key> KeyValue;
+struct FirstLess
+{
+    bool operator()(const KeyValue &a, const KeyValue &b) const
+    {return a.first < b.first;};
+};
+
+struct RBMap
+{
+    static const char *name() {return "rbmap";};
+    RedBlackTree<KeyValue, FirstLess> t;
+    bool insert(Key k) {RedBlackTreeIterator<KeyValue, FirstLess> it;
+        return t.insert(KeyValue(k, k), it);};
+    bool find(Key k) {KeyValue probe(k, 0);
+        RedBlackTreeIterator<KeyValue, FirstLess> it = t.find(probe);
+        return it.valid() && it.getDir() == 0;};
+    bool remove(Key k) {KeyValue out; return t.remove(KeyValue(k, 0), out);};
+    Key iterate() {Key sum = 0;
+        for (RedBlackTreeIterator<KeyValue, FirstLess> it = t.begin();
+             it != t.end(); ++it)
+            sum += (*it).second;
+        return sum;};
+    Key first() {return (*t.begin()).second;};
+    void clear() {t.clear();};
+};
+
+struct StdMap
+{
+    static const char *name() {return "stdmap";};
+    map<Key, Key> t;
+    bool insert(Key k) {return t.insert(KeyValue(k, k)).second;};
+    bool find(Key k) {return t.find(k) != t.end();};
+    bool remove(Key k) {return t.erase(k) != 0;};
+    Key iterate() {Key sum = 0;
+        for (map<Key, Key>::iterator it = t.begin(); it != t.end(); ++it)
+            sum += it->second;
+        return sum;};
+    Key first() {return t.begin()->second;};
+    void clear() {t.clear();};
+};
+
+// keeps results alive so the compiler cannot drop the work
+static volatile Key sink;
+
+// forces memory to be reread, so that the compiler cannot hoist a
+// repeated call out of a loop
+static inline void clobber()
+{
+    asm volatile("" : : : "memory");
+}
+
+template <typename Container>
+void run(const string &order, const vector<Key> &keys)
+{
+    const char *name = Container::name();
+    size_t n = keys.size();
+    Timer timer;
+    // look keys up (and remove them) in a different order than they
+    // were inserted in
+    vector<Key> probes(keys);
+    for (size_t i = probes.size(); i > 1; --i)
+        swap(probes[i - 1], probes[mix(i + n) % i]);
+
+    Container *c = new Container();
+    size_t heap_before = heap_in_use();
+    size_t nodes = 0;
+    timer.start();
+    for (size_t i = 0; i < n; ++i) nodes += c->insert(keys[i]);
+    timer.stop();
+    size_t heap_after = heap_in_use();
+    report(name, order, nodes, "insert", n, timer);
+    report_memory(name, order, nodes, nodes,
+                  heap_before ? (double)heap_after - (double)heap_before : 0.0);
+
+    Key found = 0;
+    timer.start();
+    for (size_t i = 0; i < n; ++i) found += c->find(probes[i]);
+    timer.stop();
+    sink = found;
+    report(name, order, nodes, "find", n, timer);
+
+    timer.start();
+    sink = c->iterate();
+    timer.stop();
+    report(name, order, nodes, "iterate", nodes, timer);
+
+    size_t reps = 100000;
+    timer.start();
+    for (size_t i = 0; i < reps; ++i)
+    {
+        sink = c->first();
+        clobber();
+    }
+    timer.stop();
+    report(name, order, nodes, "begin", reps, timer);
+
+    timer.start();
+    c->clear();
+    timer.stop();
+    report(name, order, nodes, "clear", nodes, timer);
+
+    for (size_t i = 0; i < n; ++i) c->insert(keys[i]);
+    timer.start();
+    for (size_t i = 0; i < n; ++i) c->remove(probes[i]);
+    timer.stop();
+    report(name, order, nodes, "remove", n, timer);
+
+    delete c;
+}
+
+static vector<string> split(const string &s)
+{
+    vector<string> rv;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) rv.push_back(item);
+    return rv;
+}
+
+int main ( int argc, char **argv )
+{
+    vector<string> sizes = split("1000,10000,100000,1000000");
+    vector<string> orders = split("seq,random,zipf,adversarial");
+    vector<string> containers = split("rbset,stdset,rbmap,stdmap");
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string arg(argv[i]);
+        if (arg == "--sizes") sizes = split(argv[i + 1]);
+        else if (arg == "--orders") orders = split(argv[i + 1]);
+        else if (arg == "--containers") containers = split(argv[i + 1]);
+        else
+        {
+            cerr << "unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    cache_misses = new CacheMisses();
+
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        size_t n = (size_t)atof(sizes[s].c_str());
+        for (size_t o = 0; o < orders.size(); ++o)
+        {
+            vector<Key> keys = make_keys(orders[o], n);
+            if (keys.empty())
+            {
+                cerr << "unknown order " << orders[o] << endl;
+                return 1;
+            }
+            for (size_t c = 0; c < containers.size(); ++c)
+            {
+                if (containers[c] == "rbset") run<RBSet>(orders[o], keys);
+                else if (containers[c] == "stdset") run<StdSet>(orders[o], keys);
+                else if (containers[c] == "rbmap") run<RBMap>(orders[o], keys);
+                else if (containers[c] == "stdmap") run<StdMap>(orders[o], keys);
+                else
+                {
+                    cerr << "unknown container " << containers[c] << endl;
+                    return 1;
+                }
+            }
+        }
+    }
+    delete cache_misses;
+    return 0;
+}
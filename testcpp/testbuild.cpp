@@ -0,0 +1,117 @@
+#include "pyredblack/redblack.h"
+
+#include <iostream>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cstdlib>
+
+// exposes the root so that we can check the red-black invariants of
+// a bulk-built tree
+class CheckedTree : public RedBlackTree<int>
+{
+public:
+    // returns the black height, or -1 if an invariant is broken
+    int check() const {return _check(getRoot());};
+private:
+    int _check(Node<int> *node) const
+    {
+        if (!node) return 1;
+        if (node->left && node->left->parent != node) return -1;
+        if (node->right && node->right->parent != node) return -1;
+        if (node->red && ((node->left && node->left->red) ||
+                          (node->right && node->right->red))) return -1;
+        int lh = _check(node->left);
+        int rh = _check(node->right);
+        if (lh < 0 || rh < 0 || lh != rh) return -1;
+        return lh + (node->red ? 0 : 1);
+    }
+};
+
+// records the values of the nodes freed by drain
+struct RecordDispose
+{
+    vector<int> *seen;
+    void operator()(int &value) const {seen->push_back(value);}
+};
+
+int main ( int argc, char **argv )
+{
+    int errors = 0;
+    size_t sizes[] = {0, 1, 2, 3, 7, 8, 1000, 100000};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        for (unsigned threads = 1; threads <= 4; threads *= 2)
+        {
+            vector<int> input;
+            for (size_t i = 0; i < sizes[s]; ++i)
+                input.push_back(rand() % (sizes[s] + 1));
+            set<int> expected(input.begin(), input.end());
+
+            CheckedTree tree;
+            size_t n = tree.build(input.begin(), input.end(), threads);
+            vector<int> got;
+            for (RedBlackTreeIterator<int> i = tree.begin(); i != tree.end(); ++i)
+                got.push_back(*i);
+            if (n != expected.size() ||
+                !equal(got.begin(), got.end(), expected.begin()) ||
+                got.size() != expected.size() ||
+                tree.check() < 0)
+            {
+                cout << "FAILED: size " << sizes[s] << " threads "
+                     << threads << endl;
+                ++errors;
+            }
+            // tree must stay valid under further updates
+            int removed;
+            for (size_t i = 0; i < input.size(); i += 3)
+                tree.remove(input[i], removed);
+            RedBlackTreeIterator<int> found;
+            for (size_t i = 0; i < input.size(); i += 5)
+                tree.insert(input[i] * 2, found);
+            // the cached first and last nodes must follow the updates
+            for (size_t i = 0; i < input.size(); i += 3)
+                expected.erase(input[i]);
+            for (size_t i = 0; i < input.size(); i += 5)
+                expected.insert(input[i] * 2);
+            bool ends_ok = expected.empty() ? !tree.begin().valid() :
+                (*tree.begin() == *expected.begin() &&
+                 *tree.last() == *expected.rbegin());
+            if (tree.check() < 0 || !ends_ok)
+            {
+                cout << "FAILED after updates: size " << sizes[s] << endl;
+                ++errors;
+            }
+        }
+    }
+    // incremental teardown frees detached trees in bounded chunks,
+    // in order, and leaves the tree usable in the meantime
+    {
+        CheckedTree tree;
+        vector<int> input;
+        for (int i = 0; i < 100000; ++i) input.push_back(i);
+        tree.build_sorted(input.begin(), input.end());
+        tree.detach();
+        RedBlackTreeIterator<int> found;
+        tree.insert(-1, found);
+        vector<int> seen;
+        RecordDispose dispose = {&seen};
+        size_t freed, chunks = 0;
+        bool chunks_ok = true;
+        while ((freed = tree.drain(1000, dispose)) > 0)
+        {
+            chunks_ok = chunks_ok && freed <= 1000;
+            ++chunks;
+        }
+        if (!chunks_ok || chunks != 100 || seen != input ||
+            tree.has_detached() || *tree.begin() != -1 || tree.check() < 0)
+        {
+            cout << "FAILED: incremental teardown" << endl;
+            ++errors;
+        }
+        // anything still detached is freed with the tree
+        tree.detach();
+    }
+    cout << "errors: " << errors << endl;
+    return errors ? 1 : 0;
+}
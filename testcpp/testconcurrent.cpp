@@ -0,0 +1,55 @@
+#include "pyredblack/concurrent.h"
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+
+// one writer churns the odd numbers in and out of the tree while
+// readers check that the even numbers (inserted up front and never
+// touched) are always visible and that snapshots stay sorted
+
+static const int N = 10000;
+
+int main ( int argc, char **argv )
+{
+    ConcurrentRedBlackTree<int> tree;
+    for (int i = 0; i < N; i += 2) tree.insert(i);
+
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r)
+    {
+        readers.push_back(std::thread([&tree, &done, &errors, r]() {
+            unsigned seed = r;
+            while (!done.load())
+            {
+                int key = (rand_r(&seed) % (N / 2)) * 2;
+                int found = -1;
+                if (!tree.find(key, found) || found != key) ++errors;
+                vector<int> snap;
+                tree.snapshot(snap);
+                for (size_t i = 1; i < snap.size(); ++i)
+                    if (snap[i - 1] >= snap[i]) ++errors;
+            }
+        }));
+    }
+
+    for (int round = 0; round < 20; ++round)
+    {
+        for (int i = 1; i < N; i += 2) tree.insert(i);
+        for (int i = 1; i < N; i += 2)
+        {
+            int removed;
+            tree.remove(i, removed);
+        }
+    }
+    done.store(true);
+    for (size_t r = 0; r < readers.size(); ++r) readers[r].join();
+
+    cout << "size: " << tree.size() << " errors: " << errors.load() << endl;
+    return (errors.load() == 0 && tree.size() == (size_t)N / 2) ? 0 : 1;
+}
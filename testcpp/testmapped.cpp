@@ -0,0 +1,117 @@
+#include "pyredblack/mappedtree.h"
+
+#include <iostream>
+#include <utility>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+
+// copies `path` to `out` with `size` bytes at `offset` overwritten by
+// `bytes` (or, with no bytes, cut off at `offset`)
+static void corrupt(const char *path, const char *out, size_t offset,
+                    const void *bytes, size_t size)
+{
+    FILE *f = fopen(path, "rb");
+    vector<char> data;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    if (bytes) memcpy(&data[offset], bytes, size);
+    else data.resize(offset);
+    f = fopen(out, "wb");
+    fwrite(&data[0], 1, data.size(), f);
+    fclose(f);
+}
+
+typedef pair<int, double> Entry;
+
+int main ( int argc, char **argv )
+{
+    int errors = 0;
+    const char *path = "testmapped.dat";
+
+    RedBlackTree<Entry> tree;
+    RedBlackTreeIterator<Entry> found;
+    for (int i = 0; i < 1000; ++i)
+        tree.insert(Entry((i * 7919) % 1000 * 2, i * 0.5), found);
+    if (!MappedRedBlackTree<int, double>::write(path, tree.begin(), tree.end()))
+    {
+        cout << "FAILED: write" << endl;
+        return 1;
+    }
+
+    // two independent mappings of the same file
+    MappedRedBlackTree<int, double> a, b;
+    if (!a.open(path) || !b.open(path) || a.size() != 1000)
+    {
+        cout << "FAILED: open" << endl;
+        return 1;
+    }
+    // iteration visits the same entries as the source tree
+    RedBlackTreeIterator<Entry> src = tree.begin();
+    for (MappedRedBlackTree<int, double>::iterator it = a.begin();
+         it != a.end(); ++it, ++src)
+    {
+        if ((*it).first != (*src).first || (*it).second != (*src).second)
+            ++errors;
+    }
+    // point lookups and bounds: keys are the even numbers 0..1998
+    for (int key = -1; key <= 2000; ++key)
+    {
+        MappedRedBlackTree<int, double>::iterator it = b.find(key);
+        bool present = (key >= 0 && key < 2000 && key % 2 == 0);
+        if (present != (it.valid() && it.getDir() == 0)) ++errors;
+        it = b.lower_bound(key);
+        int expected = (key < 0 ? 0 : key + key % 2);
+        if (expected >= 2000 ? it.valid() : (!it.valid() || (*it).first != expected))
+            ++errors;
+        it = b.upper_bound(key);
+        expected = (key < 0 ? 0 : key + 2 - key % 2);
+        if (expected >= 2000 ? it.valid() : (!it.valid() || (*it).first != expected))
+            ++errors;
+    }
+    // a file written for different types is rejected
+    MappedRedBlackTree<long, long> wrong;
+    if (wrong.open(path)) ++errors;
+
+    // corrupt files are rejected up front, or searched without
+    // reading outside the mapping
+    const char *bad = "testmapped.bad";
+    typedef MappedNode<int, double> Node;
+    uint64_t huge = ((uint64_t)1 << 63) / sizeof(Node) * 4 + 1;
+    uint64_t index = 5000;
+    MappedRedBlackTree<int, double> c;
+    corrupt(path, bad, offsetof(MappedHeader, count), &huge, sizeof(huge));
+    if (c.open(bad)) ++errors;
+    corrupt(path, bad, offsetof(MappedHeader, root), &index, sizeof(index));
+    if (c.open(bad)) ++errors;
+    corrupt(path, bad, sizeof(MappedHeader) + 10, 0, 0);
+    if (c.open(bad)) ++errors;
+    // every child link points outside the file
+    {
+        FILE *f = fopen(path, "rb");
+        vector<char> data(sizeof(MappedHeader) + 1000 * sizeof(Node));
+        if (fread(&data[0], 1, data.size(), f) != data.size()) ++errors;
+        fclose(f);
+        Node *nodes = (Node*)&data[sizeof(MappedHeader)];
+        for (int i = 0; i < 1000; ++i)
+        {
+            if (nodes[i].left != RB_MAPPED_NIL) nodes[i].left = index;
+            if (nodes[i].right != RB_MAPPED_NIL) nodes[i].right = index;
+        }
+        f = fopen(bad, "wb");
+        fwrite(&data[0], 1, data.size(), f);
+        fclose(f);
+    }
+    if (!c.open(bad) || c.find(0).valid() || c.lower_bound(1998).valid())
+        ++errors;
+    c.close();
+    remove(bad);
+
+    remove(path);
+    cout << "errors: " << errors << endl;
+    return errors ? 1 : 0;
+}
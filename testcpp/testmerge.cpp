@@ -0,0 +1,70 @@
+#include "pyredblack/merge.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+int main ( int argc, char **argv )
+{
+    int errors = 0;
+    const size_t k = 7;
+    vector< RedBlackTree<int>* > trees;
+    vector<int> all;
+    RedBlackTreeIterator<int> found;
+    for (size_t t = 0; t < k; ++t)
+    {
+        trees.push_back(new RedBlackTree<int>());
+        for (int i = 0; i < 500; ++i)
+        {
+            int value = rand() % 2000;
+            if (trees[t]->insert(value, found))
+                all.push_back(value);
+        }
+    }
+    sort(all.begin(), all.end());
+
+    for (int reverse = 0; reverse < 2; ++reverse)
+    {
+        for (int dedupe = 0; dedupe < 2; ++dedupe)
+        {
+            int lo = 300, hi = 1700;
+            vector<int> expected;
+            for (size_t i = 0; i < all.size(); ++i)
+                if (lo <= all[i] && all[i] < hi &&
+                    (!dedupe || expected.empty() || expected.back() != all[i]))
+                    expected.push_back(all[i]);
+            if (reverse) std::reverse(expected.begin(), expected.end());
+
+            RedBlackMerge<int> merge(dedupe, reverse);
+            for (size_t t = 0; t < k; ++t)
+                merge.add(*trees[t], &lo, &hi);
+            vector<int> got;
+            merge.drain(got);
+            if (got != expected)
+            {
+                cout << "FAILED: reverse " << reverse << " dedupe "
+                     << dedupe << endl;
+                ++errors;
+            }
+        }
+    }
+
+    // stepping backwards visits the values of a tree in reverse
+    vector<int> forwards, backwards;
+    for (RedBlackTreeIterator<int> i = trees[0]->begin(); i.valid(); ++i)
+        forwards.push_back(*i);
+    for (RedBlackTreeIterator<int> i = trees[0]->last(); i.valid(); --i)
+        backwards.push_back(*i);
+    std::reverse(backwards.begin(), backwards.end());
+    if (forwards.empty() || backwards != forwards)
+    {
+        cout << "FAILED: operator--" << endl;
+        ++errors;
+    }
+
+    for (size_t t = 0; t < k; ++t)
+        delete trees[t];
+    cout << "errors: " << errors << endl;
+    return errors ? 1 : 0;
+}